@@ -0,0 +1,515 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <map>
+#include <optional>
+
+#include "backup.h"
+#include "d64z.h"
+#include "hash.h"
+#include "output.h"
+#include "session.h"
+#include "workers.h"
+
+ComformationType conformation = overwrite_file;
+
+namespace {
+
+/// <summary>
+/// Second hash of a file, a different function than FNV-1a so two
+/// files are only taken as duplicates when both hashes match
+/// </summary>
+uint64_t contentCheck(const std::vector<uint8_t>& data)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ data.size();
+    for (auto byte : data) {
+        hash = (hash ^ byte) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// contents of some files of a source disk, by directory position
+typedef std::vector<std::optional<std::vector<uint8_t>>> SourceData;
+
+/// <summary>
+/// Read some files of a source disk
+/// </summary>
+/// <param name="path">source disk name</param>
+/// <param name="files">directory positions of the files</param>
+/// <returns>the contents in the same order, empty for a file that could not be read</returns>
+SourceData readSourceFiles(const std::string& path, const std::vector<size_t>& files)
+{
+    SourceData data(files.size());
+    d64 disk;
+    if (!loadImage(disk, path)) {
+        return data;
+    }
+    auto entries = disk.directory();
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i] < entries.size()) {
+            data[i] = disk.readFile(d64::Trim(entries[files[i]].file_name));
+        }
+    }
+    return data;
+}
+
+}
+
+/// <summary>
+/// Ask whether an existing file should be overwritten
+/// unless the user already answered for all files
+/// </summary>
+/// <param name="filename">file that already exists</param>
+/// <returns>true to overwrite, false to skip</returns>
+static bool confirmOverwrite(const std::string& filename)
+{
+    auto valid = false;
+    do {
+        if (conformation != skip_all && conformation != overwrite_all) {
+            std::cout << "File \"" << filename << "\" already exists. Overwrite?  (y/n or a=all/x=none):";
+            char response;
+            if (!(std::cin >> response)) {
+                // no more answers, keep what is there
+                conformation = skip_all;
+                continue;
+            }
+            response = toupper(response);
+            switch (response) {
+                case 'Y':
+                    conformation = overwrite_file;
+                    valid = true;
+                    break;
+                case 'N':
+                    conformation = skip_file;
+                    valid = true;
+                    break;
+                case 'A':
+                    conformation = overwrite_all;
+                    valid = true;
+                    break;
+                case 'X':
+                    conformation = skip_all;
+                    valid = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+        else {
+            valid = true;
+        }
+    } while (!valid);
+
+    return conformation == overwrite_all || conformation == overwrite_file;
+}
+
+/// <summary>
+/// Load a source disk and size its files.
+/// The contents are only read to hash them, they are not kept.
+/// </summary>
+/// <param name="path">source disk name</param>
+/// <param name="hashed">true to read and hash the files</param>
+/// <returns>the files of the disk</returns>
+SourceImage readSourceImage(const std::string& path, bool hashed)
+{
+    SourceImage source;
+    source.path = path;
+
+    d64 disk;
+    if (!loadImage(disk, path)) {
+        return source;
+    }
+    source.loaded = true;
+
+    for (const auto& entry : disk.directory()) {
+        BackupFile file;
+        file.name = d64::Trim(entry.file_name);
+        file.type = static_cast<FileTypes>(entry.file_type);
+        file.blocks = entry.file_size[0] + entry.file_size[1] * 256;
+
+        if (hashed) {
+            auto fileData = disk.readFile(file.name);
+            if (!fileData.has_value()) {
+                source.failed = file.name;
+                break;
+            }
+            file.size = fileData->size();
+            file.hash = fnv1a(*fileData);
+            file.check = contentCheck(*fileData);
+        }
+        source.files.push_back(std::move(file));
+    }
+    return source;
+}
+
+/// <summary>
+/// Create a writer for the volumes basename.d64, basename1.d64 ...
+/// </summary>
+/// <param name="basename">target disk name without extension</param>
+BackupWriter::BackupWriter(const std::string& basename) : base(basename)
+{
+}
+
+/// <summary>
+/// Load the first volume or format it if it does not exist
+/// </summary>
+/// <returns>true on success</returns>
+bool BackupWriter::open()
+{
+    if (!first.acquire(base + ".d64", true, lockTimeout)) {
+        std::cerr << "Error: " << base << ".d64 is locked by another process.\n";
+        return false;
+    }
+    if (!target.load(base + ".d64")) {
+        target.formatDisk("NEW DISK");
+    }
+
+    // size of an empty volume of the same geometry
+    d64 empty(target.TRACKS > 35 ? diskType::forty_track : diskType::thirty_five_track);
+    empty.formatDisk("BACKUP");
+    capacity = empty.getFreeSectorCount();
+
+    return target.rename_disk("BACKUP");
+}
+
+/// <summary>
+/// An empty volume
+/// </summary>
+/// <param name="num">volume number, 1 for the first extra volume</param>
+/// <returns>the volume</returns>
+BackupVolume BackupWriter::newVolume(int num) const
+{
+    BackupVolume volume;
+    volume.path = base + std::to_string(num) + ".d64";
+    volume.name = "BACKUP" + std::to_string(num);
+    volume.freeBlocks = capacity;
+    volume.freeSlots = DIRECTORY_SLOTS;
+    return volume;
+}
+
+/// <summary>
+/// Assign every source file to a volume.
+/// Files whose name is already backed up are skipped or replace
+/// the earlier copy. The rest are packed first-fit-decreasing into
+/// the free blocks and directory slots of the volumes.
+/// </summary>
+/// <param name="sources">sized source files, hashed for dedup</param>
+/// <returns>the plan</returns>
+BackupPlan BackupWriter::plan(const std::vector<SourceImage>& sources)
+{
+    BackupPlan plan;
+
+    BackupVolume first;
+    first.path = base + ".d64";
+    first.name = "BACKUP";
+
+    // names already on the first volume
+    DirectoryIndex existing;
+    existing.build(target);
+
+    // one file per name, in source order
+    std::unordered_map<std::string, PlannedFile> byName;
+    std::vector<PlannedFile> files;
+    for (size_t s = 0; s < sources.size(); ++s) {
+        for (size_t f = 0; f < sources[s].files.size(); ++f) {
+            const auto& name = sources[s].files[f].name;
+            auto found = byName.find(name);
+            auto onTarget = existing.find(name) != nullptr;
+            if (found != byName.end() || onTarget) {
+                if (!confirmOverwrite(name)) {
+                    std::cout << "Skipping \"" << name << "\"\n";
+                    continue;
+                }
+                std::cout << "overwriting \"" << name << "\"\n";
+                if (onTarget) {
+                    first.replaced.push_back(name);
+                    existing.remove(name);
+                }
+            }
+            byName[name] = { s, f };
+        }
+    }
+    first.freeBlocks = existing.freeBlocks();
+    first.freeSlots = existing.freeSlots();
+
+    for (const auto& [name, file] : byName) {
+        files.push_back(file);
+    }
+    std::sort(files.begin(), files.end(), [](const PlannedFile& a, const PlannedFile& b) {
+        return a.source != b.source ? a.source < b.source : a.file < b.file;
+    });
+
+    if (dedup) {
+        // keep the first copy of each content in source order
+        std::unordered_map<uint64_t, std::vector<PlannedFile>> byHash;
+        std::vector<PlannedFile> unique;
+        for (const auto& planned : files) {
+            const auto& file = sources[planned.source].files[planned.file];
+            auto& candidates = byHash[file.hash];
+            auto original = std::find_if(candidates.begin(), candidates.end(), [&](const PlannedFile& c) {
+                const auto& other = sources[c.source].files[c.file];
+                return other.type == file.type && other.size == file.size && other.check == file.check;
+            });
+            if (original != candidates.end()) {
+                plan.duplicates.push_back({ planned, *original });
+                continue;
+            }
+            candidates.push_back(planned);
+            unique.push_back(planned);
+        }
+        files = std::move(unique);
+    }
+
+    // largest first, ties in source order
+    std::sort(files.begin(), files.end(), [&](const PlannedFile& a, const PlannedFile& b) {
+        auto sa = sources[a.source].files[a.file].blocks;
+        auto sb = sources[b.source].files[b.file].blocks;
+        if (sa != sb) return sa > sb;
+        return a.source != b.source ? a.source < b.source : a.file < b.file;
+    });
+
+    plan.volumes.push_back(std::move(first));
+    for (const auto& planned : files) {
+        const auto& file = sources[planned.source].files[planned.file];
+        if (file.blocks > capacity) {
+            std::cerr << "Error: \"" << file.name << "\" is too large for a backup volume.\n";
+            ++plan.tooLarge;
+            continue;
+        }
+
+        auto volume = std::find_if(plan.volumes.begin(), plan.volumes.end(), [&](const BackupVolume& v) {
+            return v.freeBlocks >= file.blocks && v.freeSlots > 0;
+        });
+        if (volume == plan.volumes.end()) {
+            plan.volumes.push_back(newVolume(static_cast<int>(plan.volumes.size())));
+            volume = plan.volumes.end() - 1;
+        }
+        volume->files.push_back(planned);
+        volume->freeBlocks -= file.blocks;
+        --volume->freeSlots;
+        ++plan.fileCount;
+        plan.blockCount += file.blocks;
+    }
+    return plan;
+}
+
+/// <summary>
+/// Build each planned volume in memory and save it once.
+/// The files of a volume are read from their source disks on a
+/// pool of threads, only a window of sources is held at a time.
+/// </summary>
+/// <param name="plan">the plan</param>
+/// <param name="sources">source files</param>
+/// <returns>true on success</returns>
+bool BackupWriter::write(const BackupPlan& plan, const std::vector<SourceImage>& sources)
+{
+    auto ok = true;
+    for (size_t v = 0; v < plan.volumes.size(); ++v) {
+        const auto& volume = plan.volumes[v];
+
+        d64 disk;
+        if (v == 0) {
+            disk = target;
+            for (const auto& name : volume.replaced) {
+                disk.removeFile(name);
+            }
+        }
+        else {
+            disk = d64(target.TRACKS > 35 ? diskType::forty_track : diskType::thirty_five_track);
+            disk.formatDisk(volume.name);
+        }
+
+        // the files of the volume grouped by source disk
+        std::map<size_t, std::vector<size_t>> bySource;
+        for (const auto& planned : volume.files) {
+            bySource[planned.source].push_back(planned.file);
+        }
+        std::vector<std::pair<size_t, std::vector<size_t>>> groups(bySource.begin(), bySource.end());
+        std::map<std::pair<size_t, size_t>, std::vector<uint8_t>> contents;
+        orderedPipeline<SourceData>(groups.size(),
+            [&](size_t g) {
+                return readSourceFiles(sources[groups[g].first].path, groups[g].second);
+            },
+            [&](size_t g, SourceData& data) {
+                for (size_t i = 0; i < data.size(); ++i) {
+                    if (data[i].has_value()) {
+                        contents[{ groups[g].first, groups[g].second[i] }] = std::move(*data[i]);
+                    }
+                }
+            });
+
+        for (const auto& planned : volume.files) {
+            const auto& file = sources[planned.source].files[planned.file];
+            auto data = contents.find({ planned.source, planned.file });
+            if (data == contents.end() || !disk.addFile(file.name, file.type, data->second)) {
+                std::cerr << "Error: Failed to copy \"" << file.name << "\"\n";
+                ok = false;
+            }
+        }
+
+        FileLock lock;
+        if (!(v == 0 && first.isLocked()) && !lock.acquire(volume.path, true, lockTimeout)) {
+            std::cerr << "Error: " << volume.path << " is locked by another process.\n";
+            ok = false;
+            continue;
+        }
+        if (!disk.save(volume.path)) {
+            std::cerr << "Error: Failed to save " << volume.path << "\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/// <summary>
+/// Print the volume assignment of a backup
+/// </summary>
+/// <param name="plan">the plan</param>
+/// <param name="sources">source files</param>
+void printPlan(const BackupPlan& plan, const std::vector<SourceImage>& sources)
+{
+    for (const auto& volume : plan.volumes) {
+        std::cout << volume.path << ": " << volume.files.size() << " files, "
+            << volume.freeBlocks << " blocks free\n";
+        for (const auto& planned : volume.files) {
+            const auto& file = sources[planned.source].files[planned.file];
+            std::cout << std::setw(18) << file.name << std::setw(5) << file.blocks
+                << " blocks  " << sources[planned.source].path << "\n";
+        }
+    }
+}
+
+/// <summary>
+/// Write a csv listing the volume and source disk of every file.
+/// Duplicates name the file they are identical to.
+/// </summary>
+/// <param name="manifest">csv file to write</param>
+/// <param name="plan">the plan</param>
+/// <param name="sources">source files</param>
+/// <returns>true on success</returns>
+bool writeManifest(const std::string& manifest, const BackupPlan& plan, const std::vector<SourceImage>& sources)
+{
+    std::ofstream file(manifest);
+    if (!file.is_open()) {
+        std::cerr << "Error: unable to open file " << manifest << ".\n";
+        return false;
+    }
+
+    auto volumeOf = [&](const PlannedFile& planned) -> std::string {
+        for (const auto& volume : plan.volumes) {
+            if (std::find(volume.files.begin(), volume.files.end(), planned) != volume.files.end()) {
+                return volume.path;
+            }
+        }
+        return "";
+    };
+
+    OutputBuffer out(csv_format);
+    auto row = [&](const std::string& volume, const PlannedFile& planned, const std::string& duplicateOf) {
+        const auto& file = sources[planned.source].files[planned.file];
+        out.csvField(volume) << ',';
+        out.csvField(file.name) << ',' << file.blocks << ',';
+        for (auto shift = 56; shift >= 0; shift -= 8) {
+            out.hex(static_cast<uint8_t>(file.hash >> shift));
+        }
+        out << ',';
+        out.csvField(sources[planned.source].path) << ',';
+        out.csvField(duplicateOf) << '\n';
+    };
+
+    out << "volume,file,blocks,hash,source,duplicate_of\n";
+    for (const auto& volume : plan.volumes) {
+        for (const auto& planned : volume.files) {
+            row(volume.path, planned, "");
+        }
+    }
+    for (const auto& duplicate : plan.duplicates) {
+        const auto& original = sources[duplicate.original.source].files[duplicate.original.file];
+        row(volumeOf(duplicate.original), duplicate.file, original.name);
+    }
+    out.flush(file);
+    return file.good();
+}
+
+/// <summary>
+/// Backup the files of many disks to diskfile.
+/// Source disks are loaded and sized on a pool of threads, the files
+/// are planned onto as few volumes as possible and then each volume
+/// is written once with its files read again from the sources, so
+/// only the directories of the sources stay in memory.
+/// </summary>
+/// <param name="diskfile">target disk name</param>
+/// <param name="disks">source disks</param>
+/// <param name="options">dry run, deduplication and manifest</param>
+/// <returns>true on success</returns>
+bool backupDisks(const std::string& diskfile, const std::vector<std::string>& disks, const BackupOptions& options)
+{
+    auto basename = diskfile;
+    if (diskfile.ends_with(".d64") || diskfile.ends_with(".D64")) {
+        basename = diskfile.substr(0, diskfile.length() - 4);
+    }
+
+    BackupWriter writer(basename);
+    writer.dedup = options.dedup;
+    writer.lockTimeout = options.lockTimeout;
+    if (!writer.open()) {
+        std::cerr << "Error: Could not open " << basename << ".d64\n";
+        return false;
+    }
+
+    auto ok = true;
+    std::vector<SourceImage> sources;
+    sources.reserve(disks.size());
+    orderedPipeline<SourceImage>(disks.size(),
+        [&](size_t i) {
+            return readSourceImage(disks[i], options.dedup || !options.manifest.empty());
+        },
+        [&](size_t i, SourceImage& source) {
+            std::cout << "disk " << i + 1 << " of " << disks.size() << " " << source.path << '\n';
+            if (!source.loaded) {
+                std::cerr << "Error: Failed to load " << source.path << "\n";
+                ok = false;
+            }
+            else if (!source.failed.empty()) {
+                std::cerr << "Error: Failed to copy \"" << source.failed << "\"\n";
+                ok = false;
+            }
+            sources.push_back(std::move(source));
+        });
+
+    auto plan = writer.plan(sources);
+    if (plan.tooLarge > 0) {
+        ok = false;
+    }
+    std::cout << "Backup plan: " << plan.fileCount << " files, " << plan.blockCount << " blocks on "
+        << plan.volumes.size() << " volumes\n";
+    if (options.dedup) {
+        auto saved = 0;
+        for (const auto& duplicate : plan.duplicates) {
+            saved += sources[duplicate.file.source].files[duplicate.file.file].blocks;
+        }
+        std::cout << plan.duplicates.size() << " duplicate files skipped, " << saved << " blocks saved\n";
+    }
+    if (!options.manifest.empty() && !writeManifest(options.manifest, plan, sources)) {
+        ok = false;
+    }
+
+    if (options.dryRun) {
+        printPlan(plan, sources);
+        return ok;
+    }
+
+    if (!writer.write(plan, sources)) {
+        std::cerr << "Error: Backup failed.\n";
+        return false;
+    }
+    if (!ok) {
+        std::cerr << "Error: Backup incomplete: " << basename << ".d64\n";
+        return false;
+    }
+    std::cout << "Backup complete: " << basename << ".d64" << "\n";
+    return true;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "d64.h"
+#include "d64view.h"
+#include "filelock.h"
+
+enum ComformationType {
+    overwrite_file,
+    skip_file,
+    overwrite_all,
+    skip_all
+};
+
+extern ComformationType conformation;
+
+/// <summary>
+/// A file of a source disk.
+/// Only the directory entry is kept, the contents are read again
+/// when the file is written to its volume.
+/// </summary>
+struct BackupFile {
+    std::string name;
+    FileTypes type = FileTypes::PRG;
+    int blocks = 0;
+    size_t size = 0;        // bytes, when hashed
+    uint64_t hash = 0;      // FNV-1a of the contents, when hashed
+    uint64_t check = 0;     // second hash telling apart contents with the same hash
+};
+
+/// <summary>
+/// The files of one source disk
+/// </summary>
+struct SourceImage {
+    std::string path;
+    bool loaded = false;
+    std::string failed;     // first file that could not be read
+    std::vector<BackupFile> files;
+};
+
+/// <summary>
+/// A file assigned to a backup volume
+/// </summary>
+struct PlannedFile {
+    size_t source;
+    size_t file;
+
+    bool operator==(const PlannedFile&) const = default;
+};
+
+/// <summary>
+/// A file skipped because its contents match a file already backed up
+/// </summary>
+struct DuplicateFile {
+    PlannedFile file;
+    PlannedFile original;
+};
+
+/// <summary>
+/// One output disk of a backup
+/// </summary>
+struct BackupVolume {
+    std::string path;
+    std::string name;
+    int freeBlocks = 0;
+    int freeSlots = 0;
+    std::vector<PlannedFile> files;
+    std::vector<std::string> replaced;  // existing files overwritten on the first volume
+};
+
+/// <summary>
+/// Assignment of every source file to a volume, made before anything is written
+/// </summary>
+struct BackupPlan {
+    std::vector<BackupVolume> volumes;
+    std::vector<DuplicateFile> duplicates;
+    size_t fileCount = 0;
+    int blockCount = 0;
+    size_t tooLarge = 0;    // files that do not fit on an empty volume
+};
+
+/// <summary>
+/// Plans and writes a multi-volume backup.
+/// Files are sized first and packed first-fit-decreasing into
+/// volumes basename.d64, basename1.d64 ... Each volume is then
+/// built in memory from the files read again from their sources
+/// and saved once. The first volume is locked from open until the
+/// writer is done, the others while they are saved.
+/// </summary>
+class BackupWriter {
+public:
+    explicit BackupWriter(const std::string& basename);
+
+    bool dedup = false;     // skip files whose contents were already backed up
+    int lockTimeout = FileLock::DEFAULT_TIMEOUT;    // wait for a volume locked by another process
+
+    bool open();
+    BackupPlan plan(const std::vector<SourceImage>& sources);
+    bool write(const BackupPlan& plan, const std::vector<SourceImage>& sources);
+
+private:
+    BackupVolume newVolume(int num) const;
+
+    d64 target;
+    FileLock first;
+    std::string base;
+    int capacity = 0;
+};
+
+SourceImage readSourceImage(const std::string& path, bool hashed = false);
+void printPlan(const BackupPlan& plan, const std::vector<SourceImage>& sources);
+bool writeManifest(const std::string& manifest, const BackupPlan& plan, const std::vector<SourceImage>& sources);
+
+/// <summary>
+/// Options for backupDisks
+/// </summary>
+struct BackupOptions {
+    bool dryRun = false;    // only print the plan
+    bool dedup = false;     // skip byte identical files
+    std::string manifest;   // csv of where every file came from
+    int lockTimeout = FileLock::DEFAULT_TIMEOUT;
+};
+
+bool backupDisks(const std::string& diskfile, const std::vector<std::string>& disks, const BackupOptions& options = {});
@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "argparse/argparse.hpp"
+
+#include "d64.h"
+#include "backup.h"
+#include "d64view.h"
+#include "output.h"
+#include "stats.h"
+
+// Benchmark of the core disk operations.
+// Every operation runs a number of iterations on generated images
+// and is reported with its time percentiles, throughput and the
+// heap allocations it made, as json with a fixed layout.
+
+namespace {
+
+const int SCHEMA_VERSION = 1;
+
+/// <summary>
+/// An image layout to benchmark
+/// </summary>
+struct Scenario {
+    std::string name;
+    char tag;           // first letter of the file names, keeps names unique across images
+    int tracks;
+    int files;
+    size_t fileBytes;
+    std::string path;
+    std::vector<std::string> names;
+    std::vector<std::vector<uint8_t>> data;
+};
+
+/// <summary>
+/// Measurements of one iteration
+/// </summary>
+struct Sample {
+    double ns = 0;
+    uint64_t allocations = 0;
+    uint64_t allocatedBytes = 0;
+};
+
+/// <summary>
+/// Times the measured part of an iteration.
+/// Setup before start() and cleanup after stop() are not counted.
+/// </summary>
+class Timer {
+public:
+    void start()
+    {
+        startAllocations = allocationCount();
+        startBytes = allocatedBytes();
+        begin = std::chrono::steady_clock::now();
+    }
+
+    void stop()
+    {
+        auto end = std::chrono::steady_clock::now();
+        sample.ns = std::chrono::duration<double, std::nano>(end - begin).count();
+        sample.allocations = allocationCount() - startAllocations;
+        sample.allocatedBytes = allocatedBytes() - startBytes;
+    }
+
+    Sample sample;
+
+private:
+    std::chrono::steady_clock::time_point begin;
+    uint64_t startAllocations = 0;
+    uint64_t startBytes = 0;
+};
+
+/// <summary>
+/// Summary of all iterations of an operation
+/// </summary>
+struct Result {
+    std::string name;
+    size_t bytes = 0;       // bytes processed by one iteration
+    std::vector<Sample> samples;
+};
+
+// discards output of the operations so only the report is printed
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int ch) override { return ch; }
+};
+
+/// <summary>
+/// Deterministic pseudo random bytes
+/// </summary>
+std::vector<uint8_t> generateData(size_t size, uint32_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        seed = seed * 1664525u + 1013904223u;
+        byte = static_cast<uint8_t>(seed >> 24);
+    }
+    return data;
+}
+
+/// <summary>
+/// Build the scenarios: 35 and 40 tracks, few and many files,
+/// small files and files filling most of the disk
+/// </summary>
+std::vector<Scenario> makeScenarios(const std::filesystem::path& dir)
+{
+    std::vector<Scenario> scenarios;
+    auto tag = 'A';
+    for (auto tracks : { 35, 40 }) {
+        // blocks available outside the directory track
+        auto capacity = sectorCount(tracks) - sectorsPerTrack(DIR_TRACK);
+        for (auto files : { 8, 96 }) {
+            for (auto large : { false, true }) {
+                Scenario scenario;
+                scenario.name = std::to_string(tracks) + (files == 8 ? "-few" : "-many") + (large ? "-large" : "-small");
+                scenario.tag = tag++;
+                scenario.tracks = tracks;
+                scenario.files = files;
+                scenario.fileBytes = large ? static_cast<size_t>(capacity * 9 / 10 / files) * 254 - 100 : 600;
+                scenario.path = (dir / (scenario.name + ".d64")).string();
+                scenarios.push_back(std::move(scenario));
+            }
+        }
+    }
+    return scenarios;
+}
+
+/// <summary>
+/// Generate the files of a scenario and write its image
+/// </summary>
+bool createImage(Scenario& scenario)
+{
+    d64 disk(scenario.tracks == 40 ? diskType::forty_track : diskType::thirty_five_track);
+    disk.formatDisk("BENCH " + scenario.name);
+
+    for (auto i = 0; i < scenario.files; ++i) {
+        char name[17];
+        snprintf(name, sizeof(name), "%c%03d", scenario.tag, i);
+        scenario.names.push_back(name);
+        scenario.data.push_back(generateData(scenario.fileBytes, static_cast<uint32_t>(scenario.tag * 1000 + i)));
+        if (!disk.addFile(name, FileTypes::PRG, scenario.data.back())) {
+            std::cerr << "Error: unable to add " << name << " to " << scenario.name << "\n";
+            return false;
+        }
+    }
+    return disk.save(scenario.path);
+}
+
+size_t imageSize(const Scenario& scenario)
+{
+    return static_cast<size_t>(sectorCount(scenario.tracks)) * SECTOR_SIZE;
+}
+
+size_t dataSize(const Scenario& scenario)
+{
+    return scenario.fileBytes * scenario.files;
+}
+
+/// <summary>
+/// Run an operation for a number of iterations
+/// </summary>
+Result measure(const std::string& name, size_t bytes, int iterations, const std::function<void(Timer&)>& operation)
+{
+    Result result{ name, bytes, {} };
+    for (auto i = 0; i < iterations; ++i) {
+        Timer timer;
+        operation(timer);
+        result.samples.push_back(timer.sample);
+    }
+    return result;
+}
+
+/// <summary>
+/// Benchmark the single disk operations on a scenario image
+/// </summary>
+std::vector<Result> benchScenario(const Scenario& scenario, int iterations, const std::string& filter)
+{
+    std::vector<Result> results;
+    auto type = scenario.tracks == 40 ? diskType::forty_track : diskType::thirty_five_track;
+    auto wanted = [&](const std::string& op) {
+        return filter.empty() || (scenario.name + "/" + op).find(filter) != std::string::npos;
+    };
+
+    if (wanted("load")) {
+        results.push_back(measure("load", imageSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk;
+            timer.start();
+            disk.load(scenario.path);
+            timer.stop();
+        }));
+    }
+    if (wanted("list")) {
+        results.push_back(measure("list", imageSize(scenario), iterations, [&](Timer& timer) {
+            timer.start();
+            D64View disk;
+            disk.open(scenario.path);
+            OutputBuffer out;
+            out << "Directory of " << disk.diskname() << "\n";
+            for (const auto& entry : disk.directory()) {
+                out.pad(entry.name(), 15) << "  PRG " << entry.blocks() << " sectors\n";
+            }
+            timer.stop();
+        }));
+    }
+    if (wanted("add")) {
+        results.push_back(measure("add", dataSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk(type);
+            disk.formatDisk("BENCH");
+            timer.start();
+            for (auto i = 0; i < scenario.files; ++i) {
+                disk.addFile(scenario.names[i], FileTypes::PRG, scenario.data[i]);
+            }
+            timer.stop();
+        }));
+    }
+    if (wanted("extract")) {
+        results.push_back(measure("extract", dataSize(scenario), iterations, [&](Timer& timer) {
+            timer.start();
+            D64View disk;
+            disk.open(scenario.path);
+            size_t total = 0;
+            for (const auto& entry : disk.directory()) {
+                auto data = disk.readFile(entry);
+                total += data.has_value() ? data->size() : 0;
+            }
+            timer.stop();
+            if (total != dataSize(scenario)) {
+                std::cerr << "Error: " << scenario.name << " extracted " << total << " bytes\n";
+            }
+        }));
+    }
+    if (wanted("remove")) {
+        results.push_back(measure("remove", dataSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk;
+            disk.load(scenario.path);
+            timer.start();
+            for (const auto& name : scenario.names) {
+                disk.removeFile(name);
+            }
+            timer.stop();
+        }));
+    }
+    if (wanted("compact")) {
+        results.push_back(measure("compact", imageSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk;
+            disk.load(scenario.path);
+            for (size_t i = 0; i < scenario.names.size(); i += 2) {
+                disk.removeFile(scenario.names[i]);
+            }
+            timer.start();
+            disk.compactDirectory();
+            timer.stop();
+        }));
+    }
+    if (wanted("reorder")) {
+        std::vector<std::string> order(scenario.names.rbegin(), scenario.names.rend());
+        results.push_back(measure("reorder", imageSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk;
+            disk.load(scenario.path);
+            timer.start();
+            disk.reorderDirectory(order);
+            timer.stop();
+        }));
+    }
+    if (wanted("verify")) {
+        results.push_back(measure("verify", imageSize(scenario), iterations, [&](Timer& timer) {
+            d64 disk;
+            disk.load(scenario.path);
+            timer.start();
+            disk.verifyBAMIntegrity(false, "");
+            timer.stop();
+        }));
+    }
+    return results;
+}
+
+/// <summary>
+/// Benchmark a backup of all scenario images with the same track count
+/// </summary>
+Result benchBackup(const std::vector<Scenario>& scenarios, int tracks, const std::filesystem::path& dir, int iterations)
+{
+    std::vector<std::string> disks;
+    size_t bytes = 0;
+    for (const auto& scenario : scenarios) {
+        if (scenario.tracks == tracks) {
+            disks.push_back(scenario.path);
+            bytes += dataSize(scenario);
+        }
+    }
+
+    auto volumes = dir / ("backup" + std::to_string(tracks));
+    std::filesystem::create_directories(volumes);
+    return measure("backup", bytes, iterations, [&](Timer& timer) {
+        std::filesystem::remove_all(volumes);
+        std::filesystem::create_directories(volumes);
+        conformation = overwrite_all;
+        timer.start();
+        backupDisks((volumes / "backup.d64").string(), disks);
+        timer.stop();
+    });
+}
+
+/// <summary>
+/// Value at a percentile using the nearest rank
+/// </summary>
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+std::string fixed(double value, int decimals)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.*f", decimals, value);
+    return text;
+}
+
+/// <summary>
+/// Append one operation to the report
+/// </summary>
+void writeResult(OutputBuffer& out, const Result& result, bool last)
+{
+    std::vector<double> times;
+    std::vector<uint64_t> counts, bytes;
+    for (const auto& sample : result.samples) {
+        times.push_back(sample.ns);
+        counts.push_back(sample.allocations);
+        bytes.push_back(sample.allocatedBytes);
+    }
+    std::sort(times.begin(), times.end());
+    std::sort(counts.begin(), counts.end());
+    std::sort(bytes.begin(), bytes.end());
+
+    auto median = percentile(times, 50);
+    auto seconds = median / 1e9;
+
+    out << "        { \"name\": ";
+    out.jsonString(result.name);
+    out << ", \"bytes\": " << result.bytes;
+    out << ", \"min_ns\": " << fixed(times.front(), 0);
+    out << ", \"p50_ns\": " << fixed(median, 0);
+    out << ", \"p90_ns\": " << fixed(percentile(times, 90), 0);
+    out << ", \"p99_ns\": " << fixed(percentile(times, 99), 0);
+    out << ", \"max_ns\": " << fixed(times.back(), 0);
+    out << ", \"ops_per_s\": " << fixed(seconds > 0 ? 1 / seconds : 0, 1);
+    out << ", \"mb_per_s\": " << fixed(seconds > 0 ? result.bytes / seconds / 1e6 : 0, 2);
+    out << ", \"allocations\": " << static_cast<size_t>(counts[counts.size() / 2]);
+    out << ", \"allocated_bytes\": " << static_cast<size_t>(bytes[bytes.size() / 2]);
+    out << (last ? " }\n" : " },\n");
+}
+
+/// <summary>
+/// Append a group of operations to the report
+/// </summary>
+void writeGroup(OutputBuffer& out, const std::string& name, const std::string& details, const std::vector<Result>& results, bool last)
+{
+    out << "    {\n      \"name\": ";
+    out.jsonString(name);
+    out << ",\n" << details << "      \"operations\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        writeResult(out, results[i], i + 1 == results.size());
+    }
+    out << "      ]\n" << (last ? "    }\n" : "    },\n");
+}
+
+}
+
+/// <summary>
+/// Main entry point
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv"></param>
+/// <returns></returns>
+int main(int argc, char* argv[])
+{
+    argparse::ArgumentParser program("d64bench");
+
+    program.add_argument("--iterations")
+        .help("Iterations of each operation")
+        .default_value(std::string("10"));
+
+    program.add_argument("--filter")
+        .help("Only run operations whose scenario/operation name contains this text")
+        .default_value(std::string(""));
+
+    program.add_argument("--output")
+        .help("Write the json report to a file instead of stdout");
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    auto iterations = std::max(1, std::atoi(program.get<std::string>("--iterations").c_str()));
+    auto filter = program.get<std::string>("--filter");
+    enableAllocationCount();
+
+    auto dir = std::filesystem::temp_directory_path() / ("d64bench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    NullBuffer null;
+    auto console = std::cout.rdbuf(&null);
+
+    auto ok = true;
+    auto scenarios = makeScenarios(dir);
+    for (auto& scenario : scenarios) {
+        ok = ok && createImage(scenario);
+    }
+
+    OutputBuffer out(json_format);
+    if (ok) {
+        out << "{\n  \"schema\": " << SCHEMA_VERSION << ",\n  \"iterations\": " << iterations << ",\n  \"scenarios\": [\n";
+
+        std::vector<std::pair<std::string, std::string>> names;
+        std::vector<std::vector<Result>> groups;
+        for (const auto& scenario : scenarios) {
+            auto results = benchScenario(scenario, iterations, filter);
+            if (results.empty()) continue;
+
+            std::string details = "      \"tracks\": " + std::to_string(scenario.tracks) +
+                ",\n      \"files\": " + std::to_string(scenario.files) +
+                ",\n      \"file_bytes\": " + std::to_string(scenario.fileBytes) + ",\n";
+            names.emplace_back(scenario.name, details);
+            groups.push_back(std::move(results));
+        }
+        for (auto tracks : { 35, 40 }) {
+            auto name = std::to_string(tracks) + "-backup";
+            if (!filter.empty() && (name + "/backup").find(filter) == std::string::npos) continue;
+
+            names.emplace_back(name, "      \"tracks\": " + std::to_string(tracks) + ",\n      \"disks\": 4,\n");
+            groups.push_back({ benchBackup(scenarios, tracks, dir, iterations) });
+        }
+
+        for (size_t i = 0; i < groups.size(); ++i) {
+            writeGroup(out, names[i].first, names[i].second, groups[i], i + 1 == groups.size());
+        }
+        out << "  ]\n}\n";
+    }
+
+    std::cout.rdbuf(console);
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    if (!ok) {
+        std::cerr << "Error: unable to create the benchmark images\n";
+        return 1;
+    }
+
+    if (program.is_used("--output")) {
+        std::ofstream file(program.get<std::string>("--output"), std::ios::binary);
+        out.flush(file);
+        if (!file) {
+            std::cerr << "Error: unable to write " << program.get<std::string>("--output") << "\n";
+            return 1;
+        }
+    }
+    else {
+        out.flush();
+    }
+    return 0;
+}
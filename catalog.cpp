@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+
+#include "catalog.h"
+#include "d64view.h"
+#include "d64z.h"
+#include "hash.h"
+#include "workers.h"
+
+namespace {
+
+const char INDEX_MAGIC[4] = { 'D', '6', '4', 'I' };
+const uint32_t INDEX_VERSION = 1;
+
+const size_t HEADER_SIZE = 24;
+const size_t IMAGE_RECORD_SIZE = 40;
+const size_t FILE_RECORD_SIZE = 24;
+
+void put16(std::string& out, uint16_t value)
+{
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>(value >> 8);
+}
+
+void put32(std::string& out, uint32_t value)
+{
+    put16(out, static_cast<uint16_t>(value & 0xffff));
+    put16(out, static_cast<uint16_t>(value >> 16));
+}
+
+void put64(std::string& out, uint64_t value)
+{
+    put32(out, static_cast<uint32_t>(value & 0xffffffff));
+    put32(out, static_cast<uint32_t>(value >> 32));
+}
+
+uint16_t get16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t get32(const uint8_t* p)
+{
+    return get16(p) | (static_cast<uint32_t>(get16(p + 2)) << 16);
+}
+
+uint64_t get64(const uint8_t* p)
+{
+    return get32(p) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+}
+
+/// <summary>
+/// Read a catalog index
+/// </summary>
+/// <param name="indexfile">index file</param>
+/// <returns>false if the file is missing or not a valid index</returns>
+bool Catalog::load(const std::string& indexfile)
+{
+    images.clear();
+
+    std::ifstream in(indexfile, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < HEADER_SIZE || std::memcmp(data.data(), INDEX_MAGIC, 4) != 0 || get32(&data[4]) != INDEX_VERSION) {
+        return false;
+    }
+
+    auto imageCount = get32(&data[8]);
+    auto fileCount = get32(&data[12]);
+    auto stringCount = get32(&data[16]);
+    auto stringBytes = get32(&data[20]);
+
+    auto offsets = HEADER_SIZE;
+    auto strings = offsets + static_cast<size_t>(stringCount) * 4;
+    auto imageRecords = strings + stringBytes;
+    auto fileRecords = imageRecords + static_cast<size_t>(imageCount) * IMAGE_RECORD_SIZE;
+    if (data.size() != fileRecords + static_cast<size_t>(fileCount) * FILE_RECORD_SIZE) {
+        return false;
+    }
+
+    std::vector<std::string> table(stringCount);
+    for (uint32_t i = 0; i < stringCount; ++i) {
+        auto start = get32(&data[offsets + i * 4]);
+        if (start >= stringBytes) return false;
+        auto text = reinterpret_cast<const char*>(&data[strings + start]);
+        table[i] = std::string(text, strnlen(text, stringBytes - start));
+    }
+    auto string = [&](uint32_t id) { return id < table.size() ? table[id] : std::string(); };
+
+    images.resize(imageCount);
+    for (uint32_t i = 0; i < imageCount; ++i) {
+        auto p = &data[imageRecords + i * IMAGE_RECORD_SIZE];
+        auto& image = images[i];
+        image.path = string(get32(p));
+        image.diskname = string(get32(p + 4));
+        image.mtime = static_cast<int64_t>(get64(p + 8));
+        image.size = get64(p + 16);
+        auto first = get32(p + 24);
+        auto count = get32(p + 28);
+        image.freeBlocks = get16(p + 32);
+        image.tracks = p[34];
+        if (static_cast<uint64_t>(first) + count > fileCount) return false;
+
+        for (auto f = first; f < first + count; ++f) {
+            auto r = &data[fileRecords + static_cast<size_t>(f) * FILE_RECORD_SIZE];
+            CatalogFile file;
+            file.name = string(get32(r));
+            file.type = r[4];
+            file.locked = (r[5] & 1) != 0;
+            file.broken = (r[5] & 2) != 0;
+            file.blocks = get16(r + 6);
+            file.size = get32(r + 8);
+            file.hash = get64(r + 12);
+            image.files.push_back(std::move(file));
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Write the catalog index
+/// </summary>
+/// <param name="indexfile">index file</param>
+/// <returns>true on success</returns>
+bool Catalog::save(const std::string& indexfile) const
+{
+    // sorted table of unique strings
+    std::map<std::string, uint32_t> ids;
+    size_t fileCount = 0;
+    for (const auto& image : images) {
+        ids[image.path];
+        ids[image.diskname];
+        for (const auto& file : image.files) {
+            ids[file.name];
+        }
+        fileCount += image.files.size();
+    }
+
+    std::string offsets, strings;
+    uint32_t id = 0;
+    for (auto& [text, value] : ids) {
+        value = id++;
+        put32(offsets, static_cast<uint32_t>(strings.size()));
+        strings += text;
+        strings += '\0';
+    }
+
+    std::string out(INDEX_MAGIC, 4);
+    put32(out, INDEX_VERSION);
+    put32(out, static_cast<uint32_t>(images.size()));
+    put32(out, static_cast<uint32_t>(fileCount));
+    put32(out, static_cast<uint32_t>(ids.size()));
+    put32(out, static_cast<uint32_t>(strings.size()));
+    out += offsets;
+    out += strings;
+
+    uint32_t first = 0;
+    for (const auto& image : images) {
+        put32(out, ids[image.path]);
+        put32(out, ids[image.diskname]);
+        put64(out, static_cast<uint64_t>(image.mtime));
+        put64(out, image.size);
+        put32(out, first);
+        put32(out, static_cast<uint32_t>(image.files.size()));
+        put16(out, static_cast<uint16_t>(image.freeBlocks));
+        out += static_cast<char>(image.tracks);
+        out.append(5, '\0');
+        first += static_cast<uint32_t>(image.files.size());
+    }
+    for (const auto& image : images) {
+        for (const auto& file : image.files) {
+            put32(out, ids[file.name]);
+            out += static_cast<char>(file.type);
+            out += static_cast<char>((file.locked ? 1 : 0) | (file.broken ? 2 : 0));
+            put16(out, static_cast<uint16_t>(file.blocks));
+            put32(out, file.size);
+            put64(out, file.hash);
+            put32(out, 0);
+        }
+    }
+
+    // replace the old index in one step
+    auto temp = indexfile + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        if (!file.write(out.data(), out.size())) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, indexfile, ec);
+    return !ec;
+}
+
+/// <summary>
+/// Read the header and directory of an image
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>catalog entry, tracks is 0 if the image could not be read</returns>
+CatalogImage scanImage(const std::string& path)
+{
+    CatalogImage image;
+
+    D64View disk;
+    if (!disk.open(path)) {
+        return image;
+    }
+    image.tracks = disk.tracks();
+    image.diskname = disk.diskname();
+    image.freeBlocks = disk.freeSectorCount();
+
+    for (const auto& entry : disk.directory()) {
+        CatalogFile file;
+        file.name = entry.name();
+        file.type = entry.type();
+        file.locked = entry.locked();
+        file.blocks = entry.blocks();
+
+        auto data = disk.readFile(entry);
+        if (data.has_value()) {
+            file.size = static_cast<uint32_t>(data->size());
+            file.hash = fnv1a(data.value());
+        }
+        else {
+            file.broken = true;
+        }
+        image.files.push_back(std::move(file));
+    }
+    return image;
+}
+
+/// <summary>
+/// Catalog every .d64 image below a directory.
+/// Images whose modification time and size match the existing
+/// index are taken from it, the rest are parsed on a pool of threads.
+/// Each image is parsed under a shared lock, so one that another
+/// process writes in place is read before or after the write. An
+/// image that stays locked keeps its old entry, or is left out, and
+/// is scanned again next time.
+/// </summary>
+/// <param name="dir">directory to scan</param>
+/// <param name="indexfile">index to update</param>
+/// <param name="result">gets the counts</param>
+/// <param name="lockTimeout">time to wait for an image locked by another process</param>
+/// <returns>true on success</returns>
+bool scanArchive(const std::string& dir, const std::string& indexfile, ScanResult& result, int lockTimeout)
+{
+    namespace fs = std::filesystem;
+
+    Catalog previous;
+    previous.load(indexfile);
+    std::unordered_map<std::string, CatalogImage*> known;
+    for (auto& image : previous.images) {
+        known[image.path] = &image;
+    }
+
+    Catalog catalog;
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+        it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (ec) break;
+        if (!it->is_regular_file(ec)) continue;
+
+        auto extension = it->path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension != ".d64" && extension != ".d64z") continue;
+
+        CatalogImage image;
+        image.path = it->path().lexically_relative(dir).generic_string();
+        image.size = it->file_size(ec);
+        image.mtime = static_cast<int64_t>(it->last_write_time(ec).time_since_epoch().count());
+        catalog.images.push_back(std::move(image));
+        paths.push_back(it->path().string());
+    }
+    if (ec) {
+        std::cerr << "Error: unable to scan " << dir << ": " << ec.message() << "\n";
+        return false;
+    }
+
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < catalog.images.size(); ++i) {
+        auto& image = catalog.images[i];
+        auto old = known.find(image.path);
+        if (old != known.end() && old->second->mtime == image.mtime && old->second->size == image.size) {
+            image = std::move(*old->second);
+            ++result.unchanged;
+        }
+        else {
+            changed.push_back(i);
+        }
+    }
+
+    std::vector<uint8_t> locked(changed.size(), 0);
+    parallelFor(changed.size(), [&](size_t i) {
+        auto& image = catalog.images[changed[i]];
+        const auto& path = paths[changed[i]];
+        FileLock lock;
+        if (!lock.acquire(path, false, lockTimeout)) {
+            locked[i] = 1;
+            return;
+        }
+
+        // the file may have been written while waiting for the lock
+        std::error_code ec;
+        auto size = fs::file_size(path, ec);
+        if (!ec) {
+            image.size = size;
+            image.mtime = static_cast<int64_t>(fs::last_write_time(path, ec).time_since_epoch().count());
+        }
+        auto scanned = scanImage(path);
+        scanned.path = std::move(image.path);
+        scanned.mtime = image.mtime;
+        scanned.size = image.size;
+        image = std::move(scanned);
+    });
+
+    for (size_t i = 0; i < changed.size(); ++i) {
+        if (!locked[i]) {
+            continue;
+        }
+        auto& image = catalog.images[changed[i]];
+        auto old = known.find(image.path);
+        if (old != known.end()) {
+            image = std::move(*old->second);
+        }
+        else {
+            image.path.clear();
+        }
+        ++result.locked;
+    }
+    std::erase_if(catalog.images, [](const CatalogImage& image) { return image.path.empty(); });
+
+    std::sort(catalog.images.begin(), catalog.images.end(), [](const CatalogImage& a, const CatalogImage& b) {
+        return a.path < b.path;
+    });
+
+    result.images = catalog.images.size();
+    result.scanned = changed.size() - result.locked;
+    for (const auto& image : catalog.images) {
+        if (image.tracks == 0) ++result.invalid;
+        result.files += image.files.size();
+    }
+
+    if (!catalog.save(indexfile)) {
+        std::cerr << "Error: unable to write " << indexfile << "\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "filelock.h"
+
+/// <summary>
+/// A file listed in the catalog
+/// </summary>
+struct CatalogFile {
+    std::string name;
+    uint8_t type = 0;
+    bool locked = false;
+    bool broken = false;    // sector chain could not be followed
+    int blocks = 0;
+    uint32_t size = 0;      // bytes
+    uint64_t hash = 0;      // FNV-1a of the contents
+};
+
+/// <summary>
+/// A disk image listed in the catalog
+/// </summary>
+struct CatalogImage {
+    std::string path;       // relative to the scanned directory
+    std::string diskname;
+    int64_t mtime = 0;
+    uint64_t size = 0;
+    int tracks = 0;         // 0 if the file is not a valid image
+    int freeBlocks = 0;
+    std::vector<CatalogFile> files;
+};
+
+/// <summary>
+/// Catalog of the disk images in a directory tree.
+/// Stored as a binary index: a header, a sorted table of unique
+/// strings and fixed width image and file records that refer to
+/// strings by their position in the table.
+/// </summary>
+class Catalog {
+public:
+    bool load(const std::string& indexfile);
+    bool save(const std::string& indexfile) const;
+
+    std::vector<CatalogImage> images;   // sorted by path
+};
+
+/// <summary>
+/// Counts reported by a scan
+/// </summary>
+struct ScanResult {
+    size_t images = 0;
+    size_t scanned = 0;     // new or changed images that were parsed
+    size_t unchanged = 0;
+    size_t invalid = 0;
+    size_t locked = 0;      // images locked by another process, scanned next time
+    size_t files = 0;
+};
+
+CatalogImage scanImage(const std::string& path);
+bool scanArchive(const std::string& dir, const std::string& indexfile, ScanResult& result, int lockTimeout = FileLock::DEFAULT_TIMEOUT);
@@ -0,0 +1,396 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "d64view.h"
+#include "d64z.h"
+#include "stats.h"
+
+/// <summary>
+/// Number of sectors on a track
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <returns>sectors on the track</returns>
+int sectorsPerTrack(int track)
+{
+    if (track <= 17) return 21;
+    if (track <= 24) return 19;
+    if (track <= 30) return 18;
+    return 17;
+}
+
+/// <summary>
+/// Position of a sector in the image counted in sectors
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <param name="sector">sector on the track</param>
+/// <returns>sector number from the start of the image</returns>
+int sectorIndex(int track, int sector)
+{
+    auto index = 0;
+    for (auto t = 1; t < track; ++t) {
+        index += sectorsPerTrack(t);
+    }
+    return index + sector;
+}
+
+/// <summary>
+/// Number of sectors of an image
+/// </summary>
+/// <param name="tracks">35 or 40</param>
+/// <returns>sector count</returns>
+int sectorCount(int tracks)
+{
+    return sectorIndex(tracks + 1, 0);
+}
+
+/// <summary>
+/// Offset of a track's entry in the BAM sector.
+/// Tracks 36 - 40 use the SpeedDOS BAM layout.
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <returns>offset of the free count, the bitmap follows</returns>
+int bamOffset(int track)
+{
+    return track <= 35 ? 4 * track : 0xC0 + 4 * (track - 36);
+}
+
+/// <summary>
+/// Raw image bytes of a d64 held in memory
+/// </summary>
+/// <param name="disk">disk to copy</param>
+/// <returns>all sectors in file order</returns>
+std::vector<uint8_t> imageBytes(d64& disk)
+{
+    std::vector<uint8_t> bytes(static_cast<size_t>(sectorCount(disk.TRACKS)) * SECTOR_SIZE);
+    auto dest = bytes.begin();
+    for (auto track = 1; track <= disk.TRACKS; ++track) {
+        for (auto sector = 0; sector < disk.SECTORS_PER_TRACK[track - 1]; ++sector) {
+            auto data = disk.readSector(track, sector);
+            if (data.has_value()) {
+                std::copy_n(data->begin(), std::min<size_t>(data->size(), SECTOR_SIZE), dest);
+            }
+            dest += SECTOR_SIZE;
+        }
+    }
+    return bytes;
+}
+
+/// <summary>
+/// Convert a name padded with shifted spaces to a string
+/// </summary>
+/// <param name="text">name bytes</param>
+/// <returns>name without padding</returns>
+std::string petsciiTrim(std::span<const uint8_t> text)
+{
+    auto end = text.size();
+    while (end > 0 && (text[end - 1] == 0xA0 || text[end - 1] == ' ' || text[end - 1] == 0)) {
+        --end;
+    }
+    return std::string(text.begin(), text.begin() + end);
+}
+
+D64View::~D64View()
+{
+    close();
+}
+
+/// <summary>
+/// Check the image size and work out the track count
+/// </summary>
+/// <param name="size">file size</param>
+/// <returns>true for a 35 or 40 track image, with or without error bytes</returns>
+bool D64View::setSize(size_t size)
+{
+    for (auto tracks : { 35, 40 }) {
+        size_t sectors = sectorCount(tracks);
+        if (size == sectors * SECTOR_SIZE || size == sectors * (SECTOR_SIZE + 1)) {
+            trackCount = tracks;
+            errorTable = size != sectors * SECTOR_SIZE;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+/// Map an image file.
+/// A .d64z container is unpacked into memory.
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>true on success</returns>
+bool D64View::open(const std::string& path)
+{
+    PhaseTimer timer(load_phase);
+    close();
+
+    if (isCompressedImage(path)) {
+        std::vector<uint8_t> raw;
+        if (!readImageFile(path, raw)) {
+            return false;
+        }
+        assign(std::move(raw));
+        return isOpen();
+    }
+
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !setSize(static_cast<size_t>(st.st_size))) {
+        ::close(fd);
+        return false;
+    }
+
+    auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    base = static_cast<const uint8_t*>(map);
+    mappedSize = st.st_size;
+    touched.assign(sectorCount(trackCount), false);
+    return true;
+}
+
+/// <summary>
+/// View an image already in memory
+/// </summary>
+/// <param name="bytes">image bytes</param>
+void D64View::assign(std::vector<uint8_t> bytes)
+{
+    close();
+    owned = std::move(bytes);
+    if (setSize(owned.size())) {
+        base = owned.data();
+    }
+}
+
+/// <summary>
+/// Release the mapping
+/// </summary>
+void D64View::close()
+{
+    if (mappedSize > 0) {
+        munmap(const_cast<uint8_t*>(base), mappedSize);
+    }
+    base = nullptr;
+    mappedSize = 0;
+    owned.clear();
+    trackCount = 0;
+    errorTable = false;
+    touched.clear();
+}
+
+/// <summary>
+/// Count mapped sectors that are looked at for the first time as read
+/// </summary>
+/// <param name="first">first sector by sectorIndex</param>
+/// <param name="count">number of sectors</param>
+void D64View::countRead(size_t first, size_t count) const
+{
+    if (mappedSize == 0 || !statsEnabled()) {
+        return;
+    }
+    uint64_t read = 0;
+    for (auto index = first; index < first + count && index < touched.size(); ++index) {
+        if (!touched[index]) {
+            touched[index] = true;
+            ++read;
+        }
+    }
+    countImageRead(read, read * SECTOR_SIZE);
+}
+
+/// <summary>
+/// All sectors of the image without the error bytes
+/// </summary>
+std::span<const uint8_t> D64View::bytes() const
+{
+    auto sectors = static_cast<size_t>(sectorCount(trackCount));
+    countRead(0, sectors);
+    return { base, sectors * SECTOR_SIZE };
+}
+
+/// <summary>
+/// Error bytes after the sectors, empty if the image has none
+/// </summary>
+std::span<const uint8_t> D64View::errorBytes() const
+{
+    if (!isOpen() || !errorTable) {
+        return {};
+    }
+    auto sectors = static_cast<size_t>(sectorCount(trackCount));
+    return { base + sectors * SECTOR_SIZE, sectors };
+}
+
+/// <summary>
+/// A sector of the image
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <param name="sector">sector on the track</param>
+/// <returns>256 bytes or an empty span if the sector does not exist</returns>
+std::span<const uint8_t> D64View::sector(int track, int sector) const
+{
+    if (!isOpen() || track < 1 || track > trackCount || sector < 0 || sector >= sectorsPerTrack(track)) {
+        return {};
+    }
+    auto index = static_cast<size_t>(sectorIndex(track, sector));
+    countRead(index, 1);
+    return { base + index * SECTOR_SIZE, SECTOR_SIZE };
+}
+
+/// <summary>
+/// Error byte of a sector.
+/// 0 and 1 both mean the sector reads fine, 0 is returned as 1 and
+/// so is every sector of an image without an error table.
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <param name="sector">sector on the track</param>
+/// <returns>error code, 0 if the sector does not exist</returns>
+int D64View::errorCode(int track, int sector) const
+{
+    if (this->sector(track, sector).empty()) {
+        return 0;
+    }
+    if (!errorTable) {
+        return 1;
+    }
+    auto code = base[static_cast<size_t>(sectorCount(trackCount)) * SECTOR_SIZE + sectorIndex(track, sector)];
+    return code == 0 ? 1 : code;
+}
+
+/// <summary>
+/// Disk name from the BAM sector
+/// </summary>
+std::string D64View::diskname() const
+{
+    auto header = bam();
+    return header.empty() ? "" : petsciiTrim(header.subspan(0x90, 16));
+}
+
+/// <summary>
+/// Return true if the BAM marks a sector free.
+/// </summary>
+/// <param name="track">track 1 - 40</param>
+/// <param name="sector">sector on the track</param>
+bool D64View::isFree(int track, int sector) const
+{
+    auto header = bam();
+    if (header.empty() || track < 1 || track > trackCount) {
+        return false;
+    }
+    auto entry = bamOffset(track);
+    return (header[entry + 1 + sector / 8] & (1 << (sector % 8))) != 0;
+}
+
+/// <summary>
+/// Number of free sectors outside the directory track
+/// </summary>
+int D64View::freeSectorCount() const
+{
+    auto header = bam();
+    if (header.empty()) {
+        return 0;
+    }
+    auto count = 0;
+    for (auto track = 1; track <= trackCount; ++track) {
+        if (track == DIR_TRACK) continue;
+        count += header[bamOffset(track)];
+    }
+    return count;
+}
+
+/// <summary>
+/// Follow a chain of linked sectors
+/// </summary>
+/// <param name="track">first track</param>
+/// <param name="sector">first sector</param>
+/// <returns>sectors of the chain, stops at a bad link or a loop</returns>
+std::vector<std::pair<int, int>> D64View::chain(int track, int sector) const
+{
+    std::vector<std::pair<int, int>> sectors;
+    std::vector<bool> visited(sectorCount(trackCount));
+
+    while (track != 0) {
+        auto data = this->sector(track, sector);
+        if (data.empty() || visited[sectorIndex(track, sector)]) {
+            break;
+        }
+        visited[sectorIndex(track, sector)] = true;
+        sectors.emplace_back(track, sector);
+        track = data[0];
+        sector = data[1];
+    }
+    return sectors;
+}
+
+/// <summary>
+/// Used entries of the directory
+/// </summary>
+/// <returns>entries in directory order</returns>
+std::vector<DirEntryView> D64View::directory() const
+{
+    std::vector<DirEntryView> entries;
+    auto header = bam();
+    if (header.empty()) {
+        return entries;
+    }
+
+    for (const auto& [track, sector] : chain(header[0], header[1])) {
+        auto data = this->sector(track, sector);
+        for (auto slot = 0; slot < 8; ++slot) {
+            DirEntryView entry{ data.subspan(slot * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE), track, sector, slot };
+            if (entry.raw[2] != 0) {
+                entries.push_back(entry);
+            }
+        }
+    }
+    return entries;
+}
+
+/// <summary>
+/// Find a directory entry by name
+/// </summary>
+/// <param name="name">file name</param>
+/// <returns>the entry if found</returns>
+std::optional<DirEntryView> D64View::findFile(const std::string& name) const
+{
+    for (const auto& entry : directory()) {
+        if (entry.name() == name) {
+            return entry;
+        }
+    }
+    return std::nullopt;
+}
+
+/// <summary>
+/// Read the contents of a file
+/// </summary>
+/// <param name="entry">directory entry of the file</param>
+/// <returns>file data or nothing if the sector chain is broken</returns>
+std::optional<std::vector<uint8_t>> D64View::readFile(const DirEntryView& entry) const
+{
+    std::vector<uint8_t> data;
+    data.reserve(static_cast<size_t>(entry.blocks()) * (SECTOR_SIZE - 2));
+
+    for (const auto& [track, sector] : chain(entry.startTrack(), entry.startSector())) {
+        auto block = this->sector(track, sector);
+        if (block[0] != 0) {
+            data.insert(data.end(), block.begin() + 2, block.end());
+            if (this->sector(block[0], block[1]).empty()) {
+                return std::nullopt;
+            }
+        }
+        else {
+            data.insert(data.end(), block.begin() + 2, block.begin() + std::max(2, block[1] + 1));
+            return data;
+        }
+    }
+    return std::nullopt;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <span>
+#include <optional>
+#include <cstdint>
+
+#include "d64.h"
+
+constexpr int SECTOR_SIZE = 256;
+constexpr int DIR_TRACK = 18;
+constexpr int DIR_ENTRY_SIZE = 32;
+
+// 18 directory sectors of 8 entries on track 18
+constexpr int DIRECTORY_SLOTS = 144;
+
+/// <summary>
+/// Number of blocks a file of a given size takes on disk.
+/// Each block holds 254 data bytes, an empty file still takes one.
+/// </summary>
+inline int fileBlocks(size_t bytes)
+{
+    return bytes == 0 ? 1 : static_cast<int>((bytes + 253) / 254);
+}
+
+int sectorsPerTrack(int track);
+int sectorIndex(int track, int sector);
+int sectorCount(int tracks);
+int bamOffset(int track);
+std::vector<uint8_t> imageBytes(d64& disk);
+std::string petsciiTrim(std::span<const uint8_t> text);
+
+/// <summary>
+/// A 32 byte directory entry inside a directory sector
+/// </summary>
+struct DirEntryView {
+    std::span<const uint8_t> raw;
+    int track = 0;      // directory sector holding the entry
+    int sector = 0;
+    int slot = 0;       // entry number 0 - 7 in that sector
+
+    uint8_t type() const { return raw[2] & 0x07; }
+    bool locked() const { return (raw[2] & 0x40) != 0; }
+    bool closed() const { return (raw[2] & 0x80) != 0; }
+    int startTrack() const { return raw[3]; }
+    int startSector() const { return raw[4]; }
+    std::span<const uint8_t> nameBytes() const { return raw.subspan(5, 16); }
+    std::string name() const { return petsciiTrim(nameBytes()); }
+    int sideTrack() const { return raw[21]; }
+    int sideSector() const { return raw[22]; }
+    int recordLength() const { return raw[23]; }
+    int blocks() const { return raw[30] + raw[31] * 256; }
+};
+
+/// <summary>
+/// Read-only view of a d64 image.
+/// Files are memory mapped so only the sectors that are looked at
+/// are read from disk. Sectors, the BAM and directory entries are
+/// spans into the mapping. With --stats a mapped sector is counted
+/// as read the first time it is looked at.
+/// </summary>
+class D64View {
+public:
+    D64View() = default;
+    ~D64View();
+    D64View(const D64View&) = delete;
+    D64View& operator=(const D64View&) = delete;
+
+    bool open(const std::string& path);
+    void assign(std::vector<uint8_t> bytes);
+    void close();
+
+    bool isOpen() const { return base != nullptr; }
+    int tracks() const { return trackCount; }
+    std::span<const uint8_t> bytes() const;
+    std::span<const uint8_t> errorBytes() const;
+    bool hasErrorTable() const { return errorTable; }
+
+    std::span<const uint8_t> sector(int track, int sector) const;
+    std::span<const uint8_t> bam() const { return sector(DIR_TRACK, 0); }
+    int errorCode(int track, int sector) const;
+    std::string diskname() const;
+    bool isFree(int track, int sector) const;
+    int freeSectorCount() const;
+
+    std::vector<DirEntryView> directory() const;
+    std::optional<DirEntryView> findFile(const std::string& name) const;
+    std::optional<std::vector<uint8_t>> readFile(const DirEntryView& entry) const;
+    std::vector<std::pair<int, int>> chain(int track, int sector) const;
+
+private:
+    bool setSize(size_t size);
+    void countRead(size_t first, size_t count) const;
+
+    const uint8_t* base = nullptr;
+    size_t mappedSize = 0;
+    std::vector<uint8_t> owned;
+    int trackCount = 0;
+    bool errorTable = false;    // one error byte per sector follows the sectors
+    mutable std::vector<bool> touched;  // mapped sectors counted as read
+};
@@ -0,0 +1,664 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "d64view.h"
+#include "d64z.h"
+#include "hash.h"
+#include "stats.h"
+
+namespace {
+
+/// <summary>
+/// Write bytes to an open file, sized to them, and sync them to disk
+/// </summary>
+/// <param name="fd">file open for writing</param>
+/// <param name="data">new contents of the file</param>
+/// <returns>true on success</returns>
+bool writeFile(int fd, std::span<const uint8_t> data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        auto n = pwrite(fd, data.data() + done, data.size() - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return ftruncate(fd, static_cast<off_t>(data.size())) == 0 && fsync(fd) == 0;
+}
+
+/// <summary>
+/// Sectors of a raw image, with or without error bytes
+/// </summary>
+uint64_t rawSectors(size_t size)
+{
+    return size % (SECTOR_SIZE + 1) == 0 ? size / (SECTOR_SIZE + 1) : size / SECTOR_SIZE;
+}
+
+/// <summary>
+/// Size of a file for --stats, 0 if it cannot be read
+/// </summary>
+uint64_t statsFileSize(const std::string& path)
+{
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    return ec ? 0 : static_cast<uint64_t>(size);
+}
+
+const char CONTAINER_MAGIC[4] = { 'D', '6', '4', 'Z' };
+const uint32_t CONTAINER_VERSION = 1;
+
+const size_t HEADER_SIZE = 24;
+const size_t TABLE_ENTRY_SIZE = 8;
+const size_t STREAM_HEADER_SIZE = 5;
+const size_t MIN_MATCH = 4;
+const int HASH_BITS = 12;
+
+enum SectorKind : uint8_t {
+    zero_sector,
+    fill_sector,
+    stored_sector
+};
+
+enum StreamMode : uint8_t {
+    raw_stream,
+    lz_stream
+};
+
+void put32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (auto i = 0; i < 4; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+void put64(std::vector<uint8_t>& out, uint64_t value)
+{
+    put32(out, static_cast<uint32_t>(value & 0xffffffff));
+    put32(out, static_cast<uint32_t>(value >> 32));
+}
+
+void set32(std::vector<uint8_t>& out, size_t offset, uint32_t value)
+{
+    for (auto i = 0; i < 4; ++i) {
+        out[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+uint32_t get32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t get64(const uint8_t* p)
+{
+    return get32(p) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+/// <summary>
+/// Work out the geometry of a raw image from its size
+/// </summary>
+/// <param name="size">image size</param>
+/// <param name="errorBytes">gets the number of error bytes after the sectors</param>
+/// <returns>35 or 40, 0 for an unknown size</returns>
+int imageTracks(size_t size, size_t& errorBytes)
+{
+    for (auto tracks : { 35, 40 }) {
+        size_t sectors = sectorCount(tracks);
+        if (size == sectors * SECTOR_SIZE || size == sectors * (SECTOR_SIZE + 1)) {
+            errorBytes = size - sectors * SECTOR_SIZE;
+            return tracks;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+/// Compress a block with a byte oriented LZ77.
+/// Matches are found through a hash of the next four bytes.
+/// </summary>
+void lzCompress(const uint8_t* src, size_t size, std::vector<uint8_t>& out)
+{
+    std::array<int, 1 << HASH_BITS> table;
+    table.fill(-1);
+
+    auto read32 = [&](size_t i) {
+        uint32_t value;
+        std::memcpy(&value, src + i, 4);
+        return value;
+    };
+    auto putLength = [&](size_t length) {
+        for (; length >= 255; length -= 255) {
+            out.push_back(255);
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    };
+    // literals followed by a match, the last sequence has no match
+    auto sequence = [&](size_t start, size_t literals, size_t offset, size_t match) {
+        auto extra = match > 0 ? match - MIN_MATCH : 0;
+        out.push_back(static_cast<uint8_t>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15)));
+        if (literals >= 15) {
+            putLength(literals - 15);
+        }
+        out.insert(out.end(), src + start, src + start + literals);
+        if (match > 0) {
+            out.push_back(static_cast<uint8_t>(offset & 0xff));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+            if (extra >= 15) {
+                putLength(extra - 15);
+            }
+        }
+    };
+
+    size_t anchor = 0, i = 0;
+    while (i + MIN_MATCH <= size) {
+        auto value = read32(i);
+        auto& slot = table[(value * 2654435761u) >> (32 - HASH_BITS)];
+        auto candidate = slot;
+        slot = static_cast<int>(i);
+        if (candidate < 0 || i - candidate > 0xffff || read32(candidate) != value) {
+            ++i;
+            continue;
+        }
+
+        auto length = MIN_MATCH;
+        while (i + length < size && src[candidate + length] == src[i + length]) {
+            ++length;
+        }
+        sequence(anchor, i - anchor, i - candidate, length);
+        i += length;
+        anchor = i;
+    }
+    sequence(anchor, size - anchor, 0, 0);
+}
+
+/// <summary>
+/// Decompress a block made by lzCompress
+/// </summary>
+/// <returns>false if the data is damaged or does not decode to size bytes</returns>
+bool lzDecompress(const uint8_t* in, size_t size, uint8_t* dest, size_t expected)
+{
+    size_t ip = 0, op = 0;
+    auto getLength = [&](size_t& length) {
+        uint8_t byte;
+        do {
+            if (ip >= size) return false;
+            byte = in[ip++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (ip < size) {
+        auto token = in[ip++];
+        size_t literals = token >> 4;
+        if ((literals == 15 && !getLength(literals)) || literals > size - ip || literals > expected - op) {
+            return false;
+        }
+        std::copy_n(in + ip, literals, dest + op);
+        ip += literals;
+        op += literals;
+        if (ip == size) {
+            break;
+        }
+
+        if (size - ip < 2) {
+            return false;
+        }
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !getLength(length)) {
+            return false;
+        }
+        length += MIN_MATCH;
+        if (offset == 0 || offset > op || length > expected - op) {
+            return false;
+        }
+        // byte by byte, the match may overlap the bytes it produces
+        for (size_t k = 0; k < length; ++k, ++op) {
+            dest[op] = dest[op - offset];
+        }
+    }
+    return op == expected;
+}
+
+/// <summary>
+/// Append a stream, LZ compressed unless that does not make it smaller
+/// </summary>
+void putStream(std::vector<uint8_t>& out, const uint8_t* data, size_t size)
+{
+    std::vector<uint8_t> packed;
+    lzCompress(data, size, packed);
+    auto lz = packed.size() < size;
+    out.push_back(lz ? lz_stream : raw_stream);
+    put32(out, static_cast<uint32_t>(lz ? packed.size() : size));
+    if (lz) {
+        out.insert(out.end(), packed.begin(), packed.end());
+    }
+    else {
+        out.insert(out.end(), data, data + size);
+    }
+}
+
+/// <summary>
+/// Decode a stream of expected bytes at pos
+/// </summary>
+bool getStream(const uint8_t* block, size_t size, size_t& pos, uint8_t* dest, size_t expected)
+{
+    if (size - pos < STREAM_HEADER_SIZE) {
+        return false;
+    }
+    auto mode = block[pos];
+    size_t length = get32(block + pos + 1);
+    pos += STREAM_HEADER_SIZE;
+    if (length > size - pos) {
+        return false;
+    }
+    auto data = block + pos;
+    pos += length;
+    if (mode == raw_stream) {
+        if (length != expected) return false;
+        std::copy_n(data, length, dest);
+        return true;
+    }
+    return mode == lz_stream && lzDecompress(data, length, dest, expected);
+}
+
+/// <summary>
+/// Append the block of one track
+/// </summary>
+void encodeTrack(const uint8_t* track, int sectors, std::vector<uint8_t>& out)
+{
+    std::vector<uint8_t> stored;
+    for (auto sector = 0; sector < sectors; ++sector) {
+        auto data = track + sector * SECTOR_SIZE;
+        // every byte equal to the next one
+        if (std::memcmp(data, data + 1, SECTOR_SIZE - 1) != 0) {
+            out.push_back(stored_sector);
+            stored.insert(stored.end(), data, data + SECTOR_SIZE);
+        }
+        else if (data[0] == 0) {
+            out.push_back(zero_sector);
+        }
+        else {
+            out.push_back(fill_sector);
+            out.push_back(data[0]);
+        }
+    }
+    putStream(out, stored.data(), stored.size());
+}
+
+/// <summary>
+/// Decode the block of one track
+/// </summary>
+bool decodeTrack(const uint8_t* block, size_t size, int sectors, uint8_t* dest)
+{
+    size_t pos = 0;
+    std::vector<int> stored;
+    for (auto sector = 0; sector < sectors; ++sector) {
+        if (pos >= size) {
+            return false;
+        }
+        auto data = dest + sector * SECTOR_SIZE;
+        switch (block[pos++]) {
+            case zero_sector:
+                std::memset(data, 0, SECTOR_SIZE);
+                break;
+            case fill_sector:
+                if (pos >= size) return false;
+                std::memset(data, block[pos++], SECTOR_SIZE);
+                break;
+            case stored_sector:
+                stored.push_back(sector);
+                break;
+            default:
+                return false;
+        }
+    }
+
+    std::vector<uint8_t> data(stored.size() * SECTOR_SIZE);
+    if (!getStream(block, size, pos, data.data(), data.size()) || pos != size) {
+        return false;
+    }
+    for (size_t i = 0; i < stored.size(); ++i) {
+        std::memcpy(dest + stored[i] * SECTOR_SIZE, &data[i * SECTOR_SIZE], SECTOR_SIZE);
+    }
+    return true;
+}
+
+/// <summary>
+/// Check the header and block table of a container
+/// </summary>
+bool readHeader(std::span<const uint8_t> container, int& tracks, size_t& errorBytes)
+{
+    if (container.size() < HEADER_SIZE || std::memcmp(container.data(), CONTAINER_MAGIC, 4) != 0
+        || get32(&container[4]) != CONTAINER_VERSION) {
+        return false;
+    }
+    tracks = static_cast<int>(get32(&container[8]));
+    errorBytes = get32(&container[12]);
+    if ((tracks != 35 && tracks != 40) || (errorBytes != 0 && errorBytes != static_cast<size_t>(sectorCount(tracks)))) {
+        return false;
+    }
+
+    auto table = HEADER_SIZE + (tracks + 1) * TABLE_ENTRY_SIZE;
+    if (container.size() < table) {
+        return false;
+    }
+    for (auto i = 0; i <= tracks; ++i) {
+        auto entry = &container[HEADER_SIZE + i * TABLE_ENTRY_SIZE];
+        size_t offset = get32(entry);
+        size_t size = get32(entry + 4);
+        if (offset < table || offset > container.size() || size > container.size() - offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Block of a track, or of the error bytes after the last track
+/// </summary>
+std::span<const uint8_t> block(std::span<const uint8_t> container, int index)
+{
+    auto entry = &container[HEADER_SIZE + index * TABLE_ENTRY_SIZE];
+    return container.subspan(get32(entry), get32(entry + 4));
+}
+
+/// <summary>
+/// Read the error bytes that follow the sectors of an image file
+/// </summary>
+/// <param name="path">.d64 file</param>
+/// <param name="errors">gets the error bytes, empty if the file has none</param>
+/// <returns>false if the file cannot be read</returns>
+bool readErrorBytes(const std::string& path, std::vector<uint8_t>& errors)
+{
+    errors.clear();
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        return false;
+    }
+    size_t errorBytes = 0;
+    auto size = static_cast<size_t>(in.tellg());
+    if (imageTracks(size, errorBytes) == 0 || errorBytes == 0) {
+        return true;
+    }
+    errors.resize(errorBytes);
+    in.seekg(static_cast<std::streamoff>(size - errorBytes));
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(errors.data()), static_cast<std::streamsize>(errorBytes)));
+}
+
+}
+
+/// <summary>
+/// Return true if a name is a disk image, raw or compressed
+/// </summary>
+bool isImageName(const std::string& path)
+{
+    return path.ends_with(".d64") || path.ends_with(".D64") || isCompressedImage(path);
+}
+
+/// <summary>
+/// Return true if an image file is stored as a .d64z container
+/// </summary>
+bool isCompressedImage(const std::string& path)
+{
+    return path.ends_with(".d64z") || path.ends_with(".D64Z");
+}
+
+/// <summary>
+/// Pack a raw image into a container.
+/// Empty and filled sectors take one or two bytes, the other
+/// sectors of each track are LZ compressed together.
+/// </summary>
+/// <param name="raw">sectors and optional error bytes</param>
+/// <returns>the container, empty if raw is not an image</returns>
+std::vector<uint8_t> compressImage(std::span<const uint8_t> raw)
+{
+    size_t errorBytes;
+    auto tracks = imageTracks(raw.size(), errorBytes);
+    if (tracks == 0) {
+        return {};
+    }
+
+    std::vector<uint8_t> out(CONTAINER_MAGIC, CONTAINER_MAGIC + 4);
+    put32(out, CONTAINER_VERSION);
+    put32(out, static_cast<uint32_t>(tracks));
+    put32(out, static_cast<uint32_t>(errorBytes));
+    put64(out, fnv1a(raw.data(), raw.size()));
+    out.resize(HEADER_SIZE + (tracks + 1) * TABLE_ENTRY_SIZE);
+
+    for (auto index = 0; index <= tracks; ++index) {
+        auto start = out.size();
+        if (index < tracks) {
+            auto track = index + 1;
+            encodeTrack(&raw[static_cast<size_t>(sectorIndex(track, 0)) * SECTOR_SIZE], sectorsPerTrack(track), out);
+        }
+        else {
+            auto errors = raw.size() - errorBytes;
+            putStream(out, raw.data() + errors, errorBytes);
+        }
+        set32(out, HEADER_SIZE + index * TABLE_ENTRY_SIZE, static_cast<uint32_t>(start));
+        set32(out, HEADER_SIZE + index * TABLE_ENTRY_SIZE + 4, static_cast<uint32_t>(out.size() - start));
+    }
+    return out;
+}
+
+/// <summary>
+/// Unpack a container into a raw image
+/// </summary>
+/// <param name="container">container bytes</param>
+/// <param name="raw">gets the sectors and error bytes</param>
+/// <returns>false if the container is damaged</returns>
+bool decompressImage(std::span<const uint8_t> container, std::vector<uint8_t>& raw)
+{
+    int tracks;
+    size_t errorBytes;
+    if (!readHeader(container, tracks, errorBytes)) {
+        return false;
+    }
+
+    auto sectors = static_cast<size_t>(sectorCount(tracks)) * SECTOR_SIZE;
+    raw.resize(sectors + errorBytes);
+    for (auto track = 1; track <= tracks; ++track) {
+        auto data = block(container, track - 1);
+        if (!decodeTrack(data.data(), data.size(), sectorsPerTrack(track), &raw[static_cast<size_t>(sectorIndex(track, 0)) * SECTOR_SIZE])) {
+            return false;
+        }
+    }
+    auto errors = block(container, tracks);
+    size_t pos = 0;
+    if (!getStream(errors.data(), errors.size(), pos, raw.data() + sectors, errorBytes)) {
+        return false;
+    }
+    return fnv1a(raw) == get64(&container[16]);
+}
+
+/// <summary>
+/// Unpack the sectors of one track without touching the others
+/// </summary>
+/// <param name="container">container bytes</param>
+/// <param name="track">track to decode</param>
+/// <param name="dest">gets sectorsPerTrack(track) sectors</param>
+/// <returns>false if the container or the track is damaged</returns>
+bool decompressTrack(std::span<const uint8_t> container, int track, uint8_t* dest)
+{
+    int tracks;
+    size_t errorBytes;
+    if (!readHeader(container, tracks, errorBytes) || track < 1 || track > tracks) {
+        return false;
+    }
+    auto data = block(container, track - 1);
+    return decodeTrack(data.data(), data.size(), sectorsPerTrack(track), dest);
+}
+
+/// <summary>
+/// Read the raw bytes of an image file, unpacking a container
+/// </summary>
+/// <param name="path">.d64 or .d64z file</param>
+/// <param name="raw">gets the sectors and error bytes</param>
+/// <returns>true on success</returns>
+bool readImageFile(const std::string& path, std::vector<uint8_t>& raw)
+{
+    PhaseTimer timer(load_phase);
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!isCompressedImage(path)) {
+        raw = std::move(bytes);
+        countImageRead(rawSectors(raw.size()), raw.size());
+        return true;
+    }
+    if (!decompressImage(bytes, raw)) {
+        return false;
+    }
+    countImageRead(rawSectors(raw.size()), bytes.size());
+    return true;
+}
+
+/// <summary>
+/// Write the raw bytes of an image to a file, packed for a .d64z.
+/// An existing file is overwritten in place, like the sector saves
+/// of a session, so it keeps its inode, mode, owner, hard links and
+/// file locks. A new file is written under a temporary name and
+/// renamed once it is on disk.
+/// </summary>
+/// <param name="path">.d64 or .d64z file</param>
+/// <param name="raw">sectors and optional error bytes</param>
+/// <returns>true on success</returns>
+bool writeImageFile(const std::string& path, std::span<const uint8_t> raw)
+{
+    PhaseTimer timer(save_phase);
+    auto sectors = rawSectors(raw.size());
+    std::vector<uint8_t> packed;
+    if (isCompressedImage(path)) {
+        packed = compressImage(raw);
+        if (packed.empty()) {
+            return false;
+        }
+        raw = packed;
+    }
+
+    auto fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        auto ok = writeFile(fd, raw);
+        ok = ::close(fd) == 0 && ok;
+        if (!ok) {
+            return false;
+        }
+    }
+    else {
+        if (errno != ENOENT) {
+            return false;
+        }
+        auto temp = path + ".tmp";
+        fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            return false;
+        }
+        auto ok = writeFile(fd, raw);
+        ok = ::close(fd) == 0 && ok;
+        std::error_code ec;
+        if (ok) {
+            std::filesystem::rename(temp, path, ec);
+        }
+        if (!ok || ec) {
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+    }
+    countImageWritten(sectors, raw.size());
+    return true;
+}
+
+/// <summary>
+/// Load an image file into a d64.
+/// d64 only loads from a path, a container is unpacked into
+/// a memory file that it reads.
+/// d64 keeps the sectors only, the error bytes of the file are
+/// returned separately so a save can write them back.
+/// </summary>
+/// <param name="image">gets the image</param>
+/// <param name="path">.d64 or .d64z file</param>
+/// <param name="errors">gets the error bytes, empty if the file has none</param>
+/// <returns>true on success</returns>
+bool loadImage(d64& image, const std::string& path, std::vector<uint8_t>* errors)
+{
+    PhaseTimer timer(load_phase);
+    if (!isCompressedImage(path)) {
+        if (!image.load(path)) {
+            return false;
+        }
+        if (errors && !readErrorBytes(path, *errors)) {
+            return false;
+        }
+        if (statsEnabled()) {
+            countImageRead(static_cast<uint64_t>(sectorCount(image.TRACKS)), statsFileSize(path));
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> raw;
+    if (!readImageFile(path, raw)) {
+        return false;
+    }
+    if (errors) {
+        auto sectors = static_cast<size_t>(rawSectors(raw.size())) * SECTOR_SIZE;
+        errors->assign(raw.begin() + static_cast<std::ptrdiff_t>(sectors), raw.end());
+    }
+    auto fd = memfd_create("d64z", MFD_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    auto ok = true;
+    for (size_t done = 0; ok && done < raw.size();) {
+        auto n = write(fd, raw.data() + done, raw.size() - done);
+        ok = n > 0;
+        done += ok ? static_cast<size_t>(n) : 0;
+    }
+    ok = ok && image.load("/proc/self/fd/" + std::to_string(fd));
+    ::close(fd);
+    return ok;
+}
+
+/// <summary>
+/// Save a d64 to an image file, packed for a .d64z.
+/// Error bytes are written after the sectors, they must match
+/// the geometry of the image.
+/// </summary>
+/// <param name="image">image to save</param>
+/// <param name="path">.d64 or .d64z file</param>
+/// <param name="errors">error bytes from loadImage, empty for none</param>
+/// <returns>true on success</returns>
+bool saveImage(d64& image, const std::string& path, std::span<const uint8_t> errors)
+{
+    PhaseTimer timer(save_phase);
+    if (!errors.empty()) {
+        if (errors.size() != static_cast<size_t>(sectorCount(image.TRACKS))) {
+            return false;
+        }
+        auto raw = imageBytes(image);
+        raw.insert(raw.end(), errors.begin(), errors.end());
+        return writeImageFile(path, raw);
+    }
+    if (!isCompressedImage(path)) {
+        if (!image.save(path)) {
+            return false;
+        }
+        if (statsEnabled()) {
+            countImageWritten(static_cast<uint64_t>(sectorCount(image.TRACKS)), statsFileSize(path));
+        }
+        return true;
+    }
+    return writeImageFile(path, imageBytes(image));
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "d64.h"
+
+// Compressed image container (.d64z), all numbers little endian.
+//
+//   header:   "D64Z", version (u32), tracks (u32), error bytes (u32),
+//             FNV-1a of the raw image (u64)
+//   table:    offset (u32) and size (u32) of each track block, then
+//             of the error byte block
+//   track:    a kind byte per sector: 0 all zero, 1 filled with the
+//             byte that follows, 2 stored; then the stored sectors
+//             as one stream
+//   stream:   mode (u8) 0 raw or 1 LZ, size (u32), data
+//
+// Every track block can be decoded on its own. The LZ stream is a
+// sequence of a token (literal count << 4 | match length - 4),
+// literals and a 16 bit match offset, counts of 15 continue in the
+// following bytes.
+
+bool isImageName(const std::string& path);
+bool isCompressedImage(const std::string& path);
+
+std::vector<uint8_t> compressImage(std::span<const uint8_t> raw);
+bool decompressImage(std::span<const uint8_t> container, std::vector<uint8_t>& raw);
+bool decompressTrack(std::span<const uint8_t> container, int track, uint8_t* dest);
+
+bool readImageFile(const std::string& path, std::vector<uint8_t>& raw);
+bool writeImageFile(const std::string& path, std::span<const uint8_t> raw);
+bool loadImage(d64& image, const std::string& path, std::vector<uint8_t>* errors = nullptr);
+bool saveImage(d64& image, const std::string& path, std::span<const uint8_t> errors = {});
@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+#include "diff.h"
+
+namespace {
+
+const char* kindName(SectorOwner::Kind kind)
+{
+    switch (kind) {
+        case SectorOwner::free_sector: return "free";
+        case SectorOwner::unowned: return "unowned";
+        case SectorOwner::bam: return "bam";
+        case SectorOwner::directory: return "directory";
+        case SectorOwner::file: return "file";
+        case SectorOwner::side_sector: return "side_sector";
+    }
+    return "";
+}
+
+}
+
+/// <summary>
+/// Owner as text for the report
+/// </summary>
+std::string SectorOwner::describe() const
+{
+    switch (kind) {
+        case file: return "\"" + name + "\"";
+        case side_sector: return "\"" + name + "\" side sector";
+        case bam: return "BAM";
+        default: return kindName(kind);
+    }
+}
+
+/// <summary>
+/// Work out what every sector of an image is used for
+/// by following the directory and file chains
+/// </summary>
+/// <param name="disk">image</param>
+/// <returns>owner of each sector indexed by sectorIndex</returns>
+std::vector<SectorOwner> sectorOwners(const D64View& disk)
+{
+    std::vector<SectorOwner> owners(sectorCount(disk.tracks()));
+    for (auto track = 1; track <= disk.tracks(); ++track) {
+        for (auto sector = 0; sector < sectorsPerTrack(track); ++sector) {
+            if (!disk.isFree(track, sector)) {
+                owners[sectorIndex(track, sector)].kind = SectorOwner::unowned;
+            }
+        }
+    }
+
+    auto claim = [&](const std::vector<std::pair<int, int>>& chain, SectorOwner::Kind kind, const std::string& name) {
+        for (const auto& [track, sector] : chain) {
+            auto& owner = owners[sectorIndex(track, sector)];
+            owner.kind = kind;
+            owner.name = name;
+        }
+    };
+
+    auto header = disk.bam();
+    if (header.empty()) {
+        return owners;
+    }
+    claim(disk.chain(header[0], header[1]), SectorOwner::directory, "");
+    owners[sectorIndex(DIR_TRACK, 0)] = { SectorOwner::bam, "" };
+
+    for (const auto& entry : disk.directory()) {
+        claim(disk.chain(entry.startTrack(), entry.startSector()), SectorOwner::file, entry.name());
+        if (entry.sideTrack() != 0) {
+            claim(disk.chain(entry.sideTrack(), entry.sideSector()), SectorOwner::side_sector, entry.name());
+        }
+    }
+    return owners;
+}
+
+/// <summary>
+/// Compare two images.
+/// Whole images are compared first, then each track and
+/// only the sectors of differing tracks are looked at.
+/// Sectors whose error bytes differ count as differing too.
+/// </summary>
+/// <param name="a">first image</param>
+/// <param name="b">second image</param>
+/// <returns>differing sectors with their owners in both images</returns>
+ImageDiff diffImages(const D64View& a, const D64View& b)
+{
+    ImageDiff diff;
+    diff.tracksA = a.tracks();
+    diff.tracksB = b.tracks();
+
+    auto errors = a.hasErrorTable() || b.hasErrorTable();
+    auto errorsDiffer = [&](int track) {
+        for (auto sector = 0; errors && sector < sectorsPerTrack(track); ++sector) {
+            if (a.errorCode(track, sector) != b.errorCode(track, sector)) return true;
+        }
+        return false;
+    };
+
+    auto bytesA = a.bytes();
+    auto bytesB = b.bytes();
+    if (bytesA.size() == bytesB.size() && std::memcmp(bytesA.data(), bytesB.data(), bytesA.size()) == 0) {
+        diff.identical = true;
+        for (auto track = 1; track <= a.tracks() && diff.identical; ++track) {
+            diff.identical = !errorsDiffer(track);
+        }
+        if (diff.identical) {
+            return diff;
+        }
+    }
+
+    // tracks missing from the smaller image compare against nothing
+    auto tracks = std::max(a.tracks(), b.tracks());
+    for (auto track = 1; track <= tracks; ++track) {
+        auto first = sectorIndex(track, 0);
+        auto count = sectorsPerTrack(track);
+        if (track <= a.tracks() && track <= b.tracks() &&
+            std::memcmp(&bytesA[static_cast<size_t>(first) * SECTOR_SIZE], &bytesB[static_cast<size_t>(first) * SECTOR_SIZE], static_cast<size_t>(count) * SECTOR_SIZE) == 0 &&
+            !errorsDiffer(track)) {
+            continue;
+        }
+        for (auto sector = 0; sector < count; ++sector) {
+            auto sa = a.sector(track, sector);
+            auto sb = b.sector(track, sector);
+            auto errorA = a.errorCode(track, sector);
+            auto errorB = b.errorCode(track, sector);
+            auto bytes = SECTOR_SIZE;
+            if (!sa.empty() && !sb.empty()) {
+                bytes = 0;
+                for (auto i = 0; i < SECTOR_SIZE; ++i) {
+                    bytes += sa[i] != sb[i];
+                }
+                if (bytes == 0 && errorA == errorB) continue;
+            }
+            diff.sectors.push_back({ track, sector, bytes, errorA, errorB, {}, {} });
+        }
+    }
+
+    auto ownersA = sectorOwners(a);
+    auto ownersB = sectorOwners(b);
+    std::set<std::string> files;
+    for (auto& sector : diff.sectors) {
+        auto index = static_cast<size_t>(sectorIndex(sector.track, sector.sector));
+        if (index < ownersA.size()) sector.ownerA = ownersA[index];
+        if (index < ownersB.size()) sector.ownerB = ownersB[index];
+        for (const auto* owner : { &sector.ownerA, &sector.ownerB }) {
+            if (owner->kind == SectorOwner::file || owner->kind == SectorOwner::side_sector) {
+                files.insert(owner->name);
+            }
+        }
+    }
+    diff.files.assign(files.begin(), files.end());
+    return diff;
+}
+
+/// <summary>
+/// Print a diff report
+/// </summary>
+/// <param name="pathA">first image</param>
+/// <param name="pathB">second image</param>
+/// <param name="diff">comparison result</param>
+/// <param name="out">output in the selected format</param>
+void printDiff(const std::string& pathA, const std::string& pathB, const ImageDiff& diff, OutputBuffer& out)
+{
+    if (out.json()) {
+        out << "{\"a\":";
+        out.jsonString(pathA) << ",\"b\":";
+        out.jsonString(pathB) << ",\"identical\":";
+        out.boolean(diff.identical) << ",\"tracks\":[" << diff.tracksA << "," << diff.tracksB << "],\"sectors\":[";
+        for (size_t i = 0; i < diff.sectors.size(); ++i) {
+            const auto& sector = diff.sectors[i];
+            out << (i ? "," : "") << "{\"track\":" << sector.track << ",\"sector\":" << sector.sector << ",\"bytes\":" << sector.bytes;
+            out << ",\"errors\":[" << sector.errorA << "," << sector.errorB << "]";
+            out << ",\"a\":{\"kind\":\"" << kindName(sector.ownerA.kind) << "\",\"name\":";
+            out.jsonString(sector.ownerA.name) << "},\"b\":{\"kind\":\"" << kindName(sector.ownerB.kind) << "\",\"name\":";
+            out.jsonString(sector.ownerB.name) << "}}";
+        }
+        out << "],\"files\":[";
+        for (size_t i = 0; i < diff.files.size(); ++i) {
+            out << (i ? "," : "");
+            out.jsonString(diff.files[i]);
+        }
+        out << "]}\n";
+    }
+    else if (out.csv()) {
+        out << "a,b,track,sector,bytes,a_kind,a_name,b_kind,b_name,a_error,b_error\n";
+        for (const auto& sector : diff.sectors) {
+            out.csvField(pathA) << ',';
+            out.csvField(pathB) << ',' << sector.track << ',' << sector.sector << ',' << sector.bytes << ',' << kindName(sector.ownerA.kind) << ',';
+            out.csvField(sector.ownerA.name) << ',' << kindName(sector.ownerB.kind) << ',';
+            out.csvField(sector.ownerB.name) << ',' << sector.errorA << ',' << sector.errorB << '\n';
+        }
+    }
+    else if (diff.identical) {
+        out << pathA << " and " << pathB << " are identical\n";
+    }
+    else {
+        out << pathA << " and " << pathB << " differ in " << diff.sectors.size() << " sectors\n";
+        if (diff.tracksA != diff.tracksB) {
+            out << "Track count: " << diff.tracksA << " / " << diff.tracksB << "\n";
+        }
+
+        // adjacent sectors with the same owners are shown as one range
+        for (size_t i = 0; i < diff.sectors.size();) {
+            const auto& first = diff.sectors[i];
+            auto bytes = first.bytes;
+            auto last = i;
+            while (last + 1 < diff.sectors.size()) {
+                const auto& next = diff.sectors[last + 1];
+                if (sectorIndex(next.track, next.sector) != sectorIndex(diff.sectors[last].track, diff.sectors[last].sector) + 1 ||
+                    !(next.ownerA == first.ownerA) || !(next.ownerB == first.ownerB) ||
+                    next.errorA != first.errorA || next.errorB != first.errorB) {
+                    break;
+                }
+                bytes += next.bytes;
+                ++last;
+            }
+
+            char position[64];
+            if (last == i) {
+                snprintf(position, sizeof(position), "  %2d/%-2d          %5d bytes  ", first.track, first.sector, bytes);
+            }
+            else {
+                snprintf(position, sizeof(position), "  %2d/%-2d - %2d/%-2d  %5d bytes  ", first.track, first.sector,
+                    diff.sectors[last].track, diff.sectors[last].sector, bytes);
+            }
+            out << position << first.ownerA.describe();
+            if (!(first.ownerA == first.ownerB)) {
+                out << " / " << first.ownerB.describe();
+            }
+            if (first.errorA != first.errorB && first.errorA != 0 && first.errorB != 0) {
+                out << "  error " << first.errorA << " / " << first.errorB;
+            }
+            out << "\n";
+            i = last + 1;
+        }
+        if (!diff.files.empty()) {
+            out << "Files:";
+            for (const auto& name : diff.files) {
+                out << " \"" << name << "\"";
+            }
+            out << "\n";
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "d64view.h"
+#include "output.h"
+
+/// <summary>
+/// What a sector is used for
+/// </summary>
+struct SectorOwner {
+    enum Kind {
+        free_sector,    // marked free in the BAM
+        unowned,        // allocated but not on any chain
+        bam,
+        directory,
+        file,
+        side_sector     // side sector of a REL file
+    };
+
+    Kind kind = free_sector;
+    std::string name;   // file name for file and side_sector
+
+    std::string describe() const;
+    bool operator==(const SectorOwner& other) const { return kind == other.kind && name == other.name; }
+};
+
+/// <summary>
+/// A sector that differs between two images
+/// </summary>
+struct SectorDiff {
+    int track = 0;
+    int sector = 0;
+    int bytes = 0;      // number of differing bytes
+    int errorA = 0;     // error bytes of the sector, 0 if the image lacks it
+    int errorB = 0;
+    SectorOwner ownerA;
+    SectorOwner ownerB;
+};
+
+/// <summary>
+/// Result of comparing two images
+/// </summary>
+struct ImageDiff {
+    bool identical = false;
+    int tracksA = 0;
+    int tracksB = 0;
+    std::vector<SectorDiff> sectors;
+    std::vector<std::string> files;     // files with a differing sector, sorted
+};
+
+std::vector<SectorOwner> sectorOwners(const D64View& disk);
+ImageDiff diffImages(const D64View& a, const D64View& b);
+void printDiff(const std::string& pathA, const std::string& pathB, const ImageDiff& diff, OutputBuffer& out);
@@ -0,0 +1,149 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "filelock.h"
+
+namespace {
+
+/// <summary>
+/// Lock a whole open file
+/// </summary>
+/// <param name="fd">open file</param>
+/// <param name="exclusive">write lock, else read lock</param>
+/// <param name="wait">block until the lock is free</param>
+/// <returns>0 or the errno of the failure</returns>
+int lockFile(int fd, bool exclusive, bool wait)
+{
+    struct flock lock {};
+    lock.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL) {
+        return errno;
+    }
+    // no open file description locks, flock locks the open file as well
+    return flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB)) == 0 ? 0 : errno;
+}
+
+/// <summary>
+/// Check that a path still names the open file
+/// </summary>
+bool sameFile(int fd, const std::string& path)
+{
+    struct stat opened, named;
+    return fstat(fd, &opened) == 0 && ::stat(path.c_str(), &named) == 0
+        && opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+
+}
+
+FileLock::FileLock(FileLock&& other) noexcept : fd(other.fd), exclusive(other.exclusive), file(std::move(other.file))
+{
+    other.fd = -1;
+}
+
+FileLock& FileLock::operator=(FileLock&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        fd = other.fd;
+        exclusive = other.exclusive;
+        file = std::move(other.file);
+        other.fd = -1;
+    }
+    return *this;
+}
+
+/// <summary>
+/// Lock a file.
+/// A file that does not exist yet is not locked, the command creates it.
+/// A file that cannot be opened for writing is not locked exclusive,
+/// writing it fails in the command.
+/// </summary>
+/// <param name="path">image file</param>
+/// <param name="exclusive">lock to modify the file, else to read it</param>
+/// <param name="timeoutMs">time to wait for a lock held elsewhere, WAIT_FOREVER to block</param>
+/// <returns>false if the lock was not free in time</returns>
+bool FileLock::acquire(const std::string& path, bool exclusive, int timeoutMs)
+{
+    release();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0, timeoutMs));
+    auto pause = std::chrono::milliseconds(1);
+    for (;;) {
+        auto opened = ::open(path.c_str(), (exclusive ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (opened < 0) {
+            return errno == ENOENT || errno == EACCES || errno == EROFS;
+        }
+
+        auto result = EINTR;
+        while (result == EINTR) {
+            result = lockFile(opened, exclusive, timeoutMs == WAIT_FOREVER);
+        }
+        if (result == 0 && sameFile(opened, path)) {
+            fd = opened;
+            file = path;
+            this->exclusive = exclusive;
+            return true;
+        }
+        ::close(opened);
+
+        // a file replaced while waiting is locked again at once
+        if (result == 0) {
+            continue;
+        }
+        if ((result != EAGAIN && result != EACCES && result != EWOULDBLOCK) || std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(pause);
+        pause = std::min(pause * 2, std::chrono::milliseconds(50));
+    }
+}
+
+/// <summary>
+/// Release the lock
+/// </summary>
+void FileLock::release()
+{
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/// <summary>
+/// Lock the images of a command.
+/// The images are locked in sorted order so two processes locking
+/// the same images cannot wait for each other.
+/// </summary>
+/// <param name="paths">normalized image paths</param>
+/// <param name="exclusive">lock to modify the images, else to read them</param>
+/// <param name="timeoutMs">time to wait for each lock, FileLock::WAIT_FOREVER to block</param>
+/// <param name="locks">gets the locks</param>
+/// <returns>false if an image stayed locked by another process</returns>
+bool lockImages(std::vector<std::string> paths, bool exclusive, int timeoutMs, std::vector<FileLock>& locks)
+{
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+    for (const auto& path : paths) {
+        FileLock lock;
+        if (!lock.acquire(path, exclusive, timeoutMs)) {
+            std::cerr << "Error: " << path << " is locked by another process.\n";
+            locks.clear();
+            return false;
+        }
+        if (lock.isLocked()) {
+            locks.push_back(std::move(lock));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Advisory lock of an image file, shared with other processes.
+/// Readers lock the file shared, writers exclusive. Open file
+/// description locks are used, flock where the kernel has none;
+/// both belong to the open file, so two locks of one process on the
+/// same image conflict like those of two processes.
+/// A file replaced by rename while waiting is locked again under
+/// its new inode.
+/// </summary>
+class FileLock {
+public:
+    static const int WAIT_FOREVER = -1;
+    static const int DEFAULT_TIMEOUT = 30000;   // milliseconds
+
+    FileLock() = default;
+    ~FileLock() { release(); }
+    FileLock(FileLock&& other) noexcept;
+    FileLock& operator=(FileLock&& other) noexcept;
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    bool acquire(const std::string& path, bool exclusive, int timeoutMs);
+    void release();
+
+    bool isLocked() const { return fd >= 0; }
+    bool isExclusive() const { return exclusive; }
+    const std::string& path() const { return file; }
+
+private:
+    int fd = -1;
+    bool exclusive = false;
+    std::string file;
+};
+
+bool lockImages(std::vector<std::string> paths, bool exclusive, int timeoutMs, std::vector<FileLock>& locks);
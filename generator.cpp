@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "d64.h"
+#include "d64view.h"
+#include "generator.h"
+#include "workers.h"
+
+namespace {
+
+const char* syllables[] = {
+    "ZAK", "MEGA", "BLOK", "STAR", "DEMO", "INTRO", "TUNE", "LOAD",
+    "GAME", "DATA", "PIC", "FONT", "SID", "MAP", "LEVEL", "CODE"
+};
+
+/// <summary>
+/// File name that is not on the disk yet
+/// </summary>
+std::string uniqueName(Random& rng, std::vector<std::string>& used)
+{
+    for (;;) {
+        auto name = std::string(syllables[rng.range(0, 15)]) + " " + std::to_string(rng.range(1, 999));
+        if (std::find(used.begin(), used.end(), name) == used.end()) {
+            used.push_back(name);
+            return name;
+        }
+    }
+}
+
+std::vector<uint8_t> randomData(Random& rng, size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i += 8) {
+        auto value = rng.next();
+        for (size_t b = i; b < std::min(size, i + 8); ++b) {
+            data[b] = static_cast<uint8_t>(value);
+            value >>= 8;
+        }
+    }
+    return data;
+}
+
+/// <summary>
+/// Put errors into the BAM of a saved image
+/// </summary>
+/// <param name="path">image file</param>
+/// <param name="rng">random numbers</param>
+/// <param name="image">gets a description of each error</param>
+bool corruptBAM(const std::string& path, Random& rng, GeneratedImage& image)
+{
+    std::vector<uint8_t> bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    if (bytes.size() < static_cast<size_t>(sectorCount(image.tracks)) * SECTOR_SIZE) {
+        return false;
+    }
+    auto bam = &bytes[static_cast<size_t>(sectorIndex(DIR_TRACK, 0)) * SECTOR_SIZE];
+
+    auto errors = rng.range(1, 3);
+    for (auto i = 0; i < errors; ++i) {
+        int track;
+        do {
+            track = rng.range(1, image.tracks);
+        } while (track == DIR_TRACK);
+        auto sector = rng.range(0, sectorsPerTrack(track) - 1);
+        auto entry = bamOffset(track);
+        auto& bits = bam[entry + 1 + sector / 8];
+        auto mask = static_cast<uint8_t>(1 << (sector % 8));
+
+        char text[64];
+        switch (rng.range(0, 2)) {
+            case 0:
+                // flip the bit but keep the count, the count no longer matches
+                bits ^= mask;
+                snprintf(text, sizeof(text), "bitmap %d/%d", track, sector);
+                break;
+            case 1:
+                // flip the bit and fix the count, a used sector looks free or a free one leaks
+                bits ^= mask;
+                bam[entry] = static_cast<uint8_t>(bam[entry] + ((bits & mask) ? 1 : -1));
+                snprintf(text, sizeof(text), "%s %d/%d", (bits & mask) ? "used sector free" : "free sector used", track, sector);
+                break;
+            default:
+                bam[entry] = static_cast<uint8_t>(bam[entry] + 1);
+                snprintf(text, sizeof(text), "free count track %d", track);
+                break;
+        }
+        image.corruption.push_back(text);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return out.good();
+}
+
+}
+
+uint64_t Random::next()
+{
+    auto z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+int Random::range(int low, int high)
+{
+    return low + static_cast<int>(next() % static_cast<uint64_t>(high - low + 1));
+}
+
+/// <summary>
+/// Generate one image.
+/// Fill level, number and size of files, file types, REL and
+/// locked files and fragmentation are all taken from the seed.
+/// Fragmentation comes from filler files that are removed again
+/// before the last files are added, so those files fill the gaps.
+/// </summary>
+/// <param name="path">image file to write</param>
+/// <param name="seed">seed of this image</param>
+/// <param name="corruptPercent">chance that the BAM gets errors</param>
+/// <param name="lockTimeout">time to wait for an existing image locked by another process</param>
+/// <returns>description of the image</returns>
+GeneratedImage generateImage(const std::string& path, uint64_t seed, int corruptPercent, int lockTimeout)
+{
+    Random rng(seed);
+    GeneratedImage image;
+    image.path = path;
+    image.tracks = rng.chance(25) ? 40 : 35;
+
+    d64 disk(image.tracks == 40 ? diskType::forty_track : diskType::thirty_five_track);
+    char diskname[17];
+    snprintf(diskname, sizeof(diskname), "GEN %08X", static_cast<unsigned>(seed & 0xffffffff));
+    disk.formatDisk(diskname);
+
+    auto capacity = disk.getFreeSectorCount();
+    auto target = capacity * rng.range(5, 98) / 100;
+    int fileCount;
+    switch (rng.range(0, 2)) {
+        case 0: fileCount = rng.range(1, 8); break;
+        case 1: fileCount = rng.range(8, 40); break;
+        default: fileCount = rng.range(40, 120); break;
+    }
+    auto fragmentation = rng.range(0, 100);
+    auto relPercent = rng.chance(30) ? 15 : 0;
+
+    std::vector<std::string> names;
+    std::vector<std::string> fillers;
+    std::vector<std::string> added;
+
+    auto addFile = [&](bool filler, int blocks) {
+        auto name = uniqueName(rng, names);
+        if (filler) {
+            if (disk.addFile(name, FileTypes::SEQ, randomData(rng, static_cast<size_t>(blocks) * 254))) {
+                fillers.push_back(name);
+            }
+            return;
+        }
+
+        auto size = static_cast<size_t>(blocks) * 254 - rng.range(0, 253);
+        if (rng.chance(relPercent)) {
+            auto recordLength = rng.range(10, 200);
+            size = std::max<size_t>(1, size / recordLength) * recordLength;
+            if (disk.addRelFile(name, FileTypes::REL, static_cast<uint8_t>(recordLength), randomData(rng, size))) {
+                added.push_back(name);
+                ++image.relFiles;
+            }
+            return;
+        }
+
+        auto data = randomData(rng, size);
+        auto type = FileTypes::PRG;
+        auto pick = rng.range(0, 9);
+        if (pick >= 9) type = FileTypes::USR;
+        else if (pick >= 7) type = FileTypes::SEQ;
+        if (type == FileTypes::PRG && data.size() >= 2) {
+            // load address $0801
+            data[0] = 0x01;
+            data[1] = 0x08;
+        }
+        if (disk.addFile(name, type, data)) {
+            added.push_back(name);
+        }
+    };
+
+    std::vector<int> blocks;
+    for (auto i = 0; i < fileCount; ++i) {
+        blocks.push_back(std::max(1, target / fileCount * rng.range(25, 175) / 100));
+    }
+
+    // the first files are separated by filler files
+    auto firstPass = fileCount - fileCount / 3;
+    for (auto i = 0; i < firstPass; ++i) {
+        if (fragmentation > 0 && rng.chance(fragmentation)) {
+            addFile(true, rng.range(1, 6));
+        }
+        addFile(false, blocks[i]);
+    }
+    for (const auto& name : fillers) {
+        disk.removeFile(name);
+    }
+    for (auto i = firstPass; i < fileCount; ++i) {
+        addFile(false, blocks[i]);
+    }
+    image.fragmented = fillers.empty() ? 0 : fileCount - firstPass;
+
+    for (const auto& name : added) {
+        if (rng.chance(10) && disk.lockfile(name, true)) {
+            ++image.lockedFiles;
+        }
+    }
+
+    image.files = static_cast<int>(added.size());
+    image.freeBlocks = disk.getFreeSectorCount();
+
+    // an image that is replaced is locked while it is written,
+    // a new one once it exists and the BAM errors go in
+    FileLock lock;
+    if (!lock.acquire(path, true, lockTimeout)) {
+        std::cerr << "Error: " << path << " is locked by another process.\n";
+        return image;
+    }
+    if (!disk.save(path) || (!lock.isLocked() && !lock.acquire(path, true, lockTimeout))) {
+        return image;
+    }
+
+    image.ok = rng.chance(corruptPercent) ? corruptBAM(path, rng, image) : true;
+    return image;
+}
+
+/// <summary>
+/// Generate images in parallel.
+/// Every image has its own seed derived from the base seed and its
+/// number, so the result does not depend on the number of threads.
+/// </summary>
+/// <param name="dir">directory to write the images to</param>
+/// <param name="options">seed, count and corruption</param>
+/// <returns>description of each image in order</returns>
+std::vector<GeneratedImage> generateImages(const std::string& dir, const GeneratorOptions& options)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    std::vector<GeneratedImage> images(std::max(0, options.count));
+    parallelFor(images.size(), [&](size_t i) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "disk%05zu.d64", i + 1);
+        auto path = (std::filesystem::path(dir) / filename).string();
+
+        // image i gets output i of a generator started at the base seed
+        Random seeds(options.seed + i * 0x9E3779B97F4A7C15ull);
+        images[i] = generateImage(path, seeds.next(), options.corruptPercent, options.lockTimeout);
+    });
+    return images;
+}
+
+/// <summary>
+/// Print what was generated
+/// </summary>
+/// <param name="images">generated images</param>
+/// <param name="out">output in the selected format</param>
+void printGenerated(const std::vector<GeneratedImage>& images, OutputBuffer& out)
+{
+    auto corruption = [](const GeneratedImage& image) {
+        std::string text;
+        for (const auto& error : image.corruption) {
+            text += (text.empty() ? "" : "; ") + error;
+        }
+        return text;
+    };
+
+    if (out.json()) {
+        out << "[";
+        for (size_t i = 0; i < images.size(); ++i) {
+            const auto& image = images[i];
+            out << (i ? ",\n" : "\n") << "{\"image\":";
+            out.jsonString(image.path) << ",\"ok\":";
+            out.boolean(image.ok) << ",\"tracks\":" << image.tracks << ",\"files\":" << image.files
+                << ",\"rel\":" << image.relFiles << ",\"locked\":" << image.lockedFiles << ",\"fragmented\":" << image.fragmented
+                << ",\"free\":" << image.freeBlocks << ",\"bam_errors\":[";
+            for (size_t e = 0; e < image.corruption.size(); ++e) {
+                out << (e ? "," : "");
+                out.jsonString(image.corruption[e]);
+            }
+            out << "]}";
+        }
+        out << "\n]\n";
+    }
+    else if (out.csv()) {
+        out << "image,ok,tracks,files,rel,locked,fragmented,free,bam_errors\n";
+        for (const auto& image : images) {
+            out.csvField(image.path) << ',' << (image.ok ? "1" : "0") << ',' << image.tracks << ',' << image.files << ','
+                << image.relFiles << ',' << image.lockedFiles << ',' << image.fragmented << ',' << image.freeBlocks << ',';
+            out.csvField(corruption(image)) << '\n';
+        }
+    }
+    else {
+        for (const auto& image : images) {
+            if (!image.ok) {
+                out << image.path << ": failed\n";
+                continue;
+            }
+            out << image.path << ": " << image.tracks << " tracks, " << image.files << " files ("
+                << image.relFiles << " REL, " << image.lockedFiles << " locked, " << image.fragmented << " fragmented), "
+                << image.freeBlocks << " blocks free";
+            if (!image.corruption.empty()) {
+                out << ", BAM errors: " << corruption(image);
+            }
+            out << "\n";
+        }
+    }
+}
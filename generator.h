@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "filelock.h"
+#include "output.h"
+
+/// <summary>
+/// Small deterministic random number generator (splitmix64).
+/// The standard distributions differ between libraries,
+/// this gives the same numbers everywhere.
+/// </summary>
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed) {}
+
+    uint64_t next();
+    int range(int low, int high);   // low to high inclusive
+    bool chance(int percent) { return range(0, 99) < percent; }
+
+private:
+    uint64_t state;
+};
+
+/// <summary>
+/// Settings for generate
+/// </summary>
+struct GeneratorOptions {
+    uint64_t seed = 1;
+    int count = 1;
+    int corruptPercent = 0;     // images that get BAM errors
+    int lockTimeout = FileLock::DEFAULT_TIMEOUT;    // wait for an image locked by another process
+};
+
+/// <summary>
+/// Description of a generated image
+/// </summary>
+struct GeneratedImage {
+    std::string path;
+    bool ok = false;
+    int tracks = 0;
+    int files = 0;
+    int relFiles = 0;
+    int lockedFiles = 0;
+    int fragmented = 0;         // files added after gaps were opened
+    int freeBlocks = 0;
+    std::vector<std::string> corruption;
+};
+
+GeneratedImage generateImage(const std::string& path, uint64_t seed, int corruptPercent, int lockTimeout);
+std::vector<GeneratedImage> generateImages(const std::string& dir, const GeneratorOptions& options);
+void printGenerated(const std::vector<GeneratedImage>& images, OutputBuffer& out);
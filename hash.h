@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/// <summary>
+/// 64 bit FNV-1a hash of a block of bytes
+/// </summary>
+/// <param name="data">bytes to hash</param>
+/// <param name="size">number of bytes</param>
+/// <param name="hash">hash to continue from</param>
+/// <returns>the hash</returns>
+inline uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a(const std::vector<uint8_t>& data)
+{
+    return fnv1a(data.data(), data.size());
+}
@@ -4,48 +4,76 @@
 #include <vector>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <unordered_set>
+#include <map>
+#include <mutex>
 
 #include "argparse/argparse.hpp"
 
 #include "d64.h"
-
-enum ComformationType {
-    overwrite_file,
-    skip_file,
-    overwrite_all,
-    skip_all
-};
-
-ComformationType conformation = overwrite_file;
-
-std::string diskname;
-char backup_disk_num = '0';
-std::string target_backup_base_name;
-
-bool fileExists(d64& disk, const std::string& filename);
-void Backup(const std::string& source, const std::string& target);
-bool copyFiles(d64& sourceDisk, d64& targetDisk);
+#include "session.h"
+#include "backup.h"
+#include "d64view.h"
+#include "workers.h"
+#include "catalog.h"
+#include "diff.h"
+#include "output.h"
+#include "generator.h"
+#include "verify.h"
+#include "server.h"
+#include "patch.h"
+#include "d64z.h"
+#include "optimize.h"
+#include "stats.h"
+#include "filelock.h"
+
+// current disk of the shell, or of a server connection
+thread_local std::string diskname;
+// stdin is read for commands, so it cannot be used for file data
+bool stdinCommands = false;
+SessionPool sessions;
+OutputFormat outputFormat = text_format;
+// wait for images locked by other processes, in milliseconds
+int lockTimeout = FileLock::DEFAULT_TIMEOUT;
+// exclusive locks of images with deferred changes, held until they are written
+std::map<std::string, FileLock> retainedLocks;
+std::mutex retainedLock;
 
 void handleHelp();
 void handleCreate(const std::string& diskfile, bool fortyTracks);
 void handleBAM(const std::string& diskfile);
-void handleDumpSector(const std::string& diskfile, int track, int sector);
-void handleAdd(const std::string& diskfile, const std::string& filename);
+void handleDump(const std::string& diskfile, const std::vector<std::string>& args);
+void handleAdd(const std::string& diskfile, const std::vector<std::string>& filenames);
 void handleAddRel(const std::string& diskfile, const std::string& filename, const int recordsize);
 void handleList(const std::string& diskfile);
 void handleLock(const std::string& diskfile, const std::string& filename);
 void handleLoad(const std::string& diskfile);
+void handleSave(const std::string& diskfile);
+void handleAutosave(const std::string& diskfile, const std::string& seconds);
 void handleUnlock(const std::string& diskfile, const std::string& filename);
 void handleExtract(const std::string& diskfile, const std::string& filename);
+void handleExtractList(const std::string& diskfile, const std::vector<std::string>& args);
 void handleRemove(const std::string& diskfile, const std::string& filename);
 void handleRename(const std::string& diskfile, const std::string& oldname, const std::string& newname);
 void handleVerify(const std::string& diskfile, bool fix);
+void handleVerifyList(const std::string& diskfile, const std::vector<std::string>& args);
 void handleCompact(const std::string& diskfile);
 void handleReorder(const std::string& diskfile, const std::vector<std::string>& order);
 void handleDiskRename(const std::string& diskfile, const std::string& newname);
 void handleBackup(const std::string& diskfile, const std::vector<std::string>& order);
+void handleScan(const std::string& diskfile, const std::string& dir);
+void handleDiff(const std::string& diskfile, const std::string& otherfile);
+void handleGenerate(const std::string& diskfile, const std::string& dir);
+void handleMakePatch(const std::string& diskfile, const std::string& newfile, const std::string& patchfile);
+void handlePatch(const std::string& diskfile, const std::string& patchfile);
+void handleConvert(const std::string& diskfile, const std::string& target);
+void handleOptimize(const std::string& diskfile, const std::vector<std::string>& args);
+void handleCache(const std::string& diskfile, const std::vector<std::string>& args);
 
 void interactiveShell();
+int runScript(const std::string& scriptfile);
 
 typedef enum {
     no_param,
@@ -87,25 +115,71 @@ std::map<std::string, InteractiveFunctions> functionTable = {
     {"list", {one_param, {.f1 = handleList}}},
     {"dir", {one_param, {.f1 = handleList}}},
     {"load", {one_param, {.f1 = handleLoad}}},
-    {"add", {two_param, {.f2 = handleAdd}}},
-    {"extract", {two_param, {.f2 = handleExtract}}},
+    {"add", {file_list, {.fn = handleAdd}}},
+    {"extract", {file_list, {.fn = handleExtractList}}},
     {"remove", {two_param, {.f2 = handleRemove}}},
     {"del", {two_param, {.f2 = handleRemove}}},
     {"rename", {three_param, {.f3 = handleRename}}},
     {"rename-disk", {two_param, {.f2 = handleDiskRename}}},
     {"bam", {one_param, {.f1 = handleBAM}}},
-    {"verify", {two_bool, {.fb = handleVerify}}},
+    {"verify", {file_list, {.fn = handleVerifyList}}},
     {"compact", {one_param, {.f1 = handleCompact}}},
     {"reorder", {file_list, {.fn = handleReorder}}},
     {"backup", {file_list, {.fn = handleBackup}}},
     {"lock", {two_param, {.f2 = handleLock}}},
     {"unlock", {two_param, {.f2 = handleUnlock}}},
-    {"dump", {two_int, {.fi = handleDumpSector}}},
+    {"dump", {file_list, {.fn = handleDump}}},
+    {"save", {one_param, {.f1 = handleSave}}},
+    {"autosave", {two_param, {.f2 = handleAutosave}}},
+    {"scan", {two_param, {.f2 = handleScan}}},
+    {"diff", {two_param, {.f2 = handleDiff}}},
+    {"generate", {two_param, {.f2 = handleGenerate}}},
+    {"mkpatch", {three_param, {.f3 = handleMakePatch}}},
+    {"patch", {two_param, {.f2 = handlePatch}}},
+    {"convert", {two_param, {.f2 = handleConvert}}},
+    {"optimize", {file_list, {.fn = handleOptimize}}},
+    {"cache", {file_list, {.fn = handleCache}}},
     { "load", {one_param, {.f1 = handleLoad} }}
     };
 
 argparse::ArgumentParser program("d64");
 
+/// <summary>
+/// Open a read-only view of a disk.
+/// A resident image is viewed as it is in memory,
+/// any other image file is memory mapped.
+/// </summary>
+/// <param name="view">gets the view</param>
+/// <param name="diskfile">diskfile to use</param>
+/// <returns>true on success</returns>
+bool openView(D64View& view, const std::string& diskfile)
+{
+    if (auto image = sessions.find(diskfile)) {
+        auto raw = imageBytes(image->disk());
+        raw.insert(raw.end(), image->errorBytes().begin(), image->errorBytes().end());
+        view.assign(std::move(raw));
+        return view.isOpen();
+    }
+    return view.open(diskfile);
+}
+
+/// <summary>
+/// Write every resident image with unsaved changes.
+/// The locks kept for the changes are released, so commands that
+/// lock the image files themselves do not wait for this process.
+/// </summary>
+/// <returns>true if all saves succeeded</returns>
+bool flushSessions()
+{
+    auto ok = sessions.flush();
+    std::lock_guard<std::mutex> guard(retainedLock);
+    std::erase_if(retainedLocks, [](const auto& item) {
+        auto image = sessions.find(item.first);
+        return !image || !image->isDirty();
+    });
+    return ok;
+}
+
 /// <summary>
 /// Handle help command
 /// </summary>
@@ -121,8 +195,7 @@ void handleHelp()
 void handleLoad(const std::string& diskfile)
 {
     diskname = diskfile;
-    d64 disk;
-    if (disk.load(diskname)) {
+    if (sessions.open(diskname)) {
         std::cout << "Loaded disk: " << diskname << "\n";
     }
     else {
@@ -131,6 +204,33 @@ void handleLoad(const std::string& diskfile)
     }
 }
 
+/// <summary>
+/// Write the resident d64 image
+/// </summary>
+/// <param name="diskfile">diskfile to save</param>
+void handleSave(const std::string& diskfile)
+{
+    auto image = sessions.open(diskfile);
+    if (image && image->save()) {
+        std::cout << "Saved disk: " << diskfile << "\n";
+    }
+    else {
+        std::cerr << "Error: Could not save disk.\n";
+    }
+}
+
+/// <summary>
+/// Set the autosave interval for deferred saves
+/// </summary>
+/// <param name="diskfile">unused</param>
+/// <param name="seconds">seconds between saves. 0 saves only on save/exit</param>
+void handleAutosave([[maybe_unused]] const std::string& diskfile, const std::string& seconds)
+{
+    auto interval = std::atoi(seconds.c_str());
+    sessions.setAutosaveInterval(interval);
+    std::cout << "Autosave " << (interval > 0 ? "every " + seconds + " seconds" : "off") << "\n";
+}
+
 /// <summary>
 /// Create a d64 image
 /// </summary>
@@ -140,9 +240,7 @@ void handleCreate(const std::string& diskfile, bool forty_tracks)
     diskname = diskfile;
 
     auto disktype = forty_tracks ? diskType::forty_track : diskType::thirty_five_track;
-    d64 disk(disktype);
-    disk.formatDisk("NEW DISK");
-    if (disk.save(diskname)) {
+    if (sessions.create(diskname, disktype, "NEW DISK")) {
         std::cout << "Created new disk: " << diskname << "\n";
     }
     else {
@@ -157,20 +255,44 @@ void handleCreate(const std::string& diskfile, bool forty_tracks)
 /// <param name="filename">name of file</param>
 void handleBAM(const std::string& diskfile)
 {
-    d64 disk;
+    D64View disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
-        for (auto track = 1; track <= disk.TRACKS; ++track) {
-            std::cout << std::setw(4) << track << ' ';
+    if (openView(disk, diskname)) {
+        OutputBuffer out(outputFormat);
+        if (out.json()) {
+            out << "{\"disk\":";
+            out.jsonString(diskfile) << ",\"tracks\":[";
+        }
+        else if (out.csv()) {
+            out << "image,track,free,map\n";
+        }
+
+        std::string map;
+        for (auto track = 1; track <= disk.tracks(); ++track) {
+            auto free = 0;
+            map.clear();
+            for (auto sector = 0; sector < sectorsPerTrack(track); ++sector) {
+                auto isFree = disk.isFree(track, sector);
+                free += isFree;
+                map += isFree ? '.' : '*';
+            }
 
-            for (auto sector = 0; sector < disk.SECTORS_PER_TRACK[track - 1]; ++sector) {
-                auto free = disk.bamtrack(track - 1)->test(sector);
-                auto ch = free ? '.' : '*';
-                std::cout << std::setw(0) << ch;
+            if (out.json()) {
+                out << (track > 1 ? "," : "") << "{\"track\":" << track << ",\"free\":" << free << ",\"map\":\"" << map << "\"}";
+            }
+            else if (out.csv()) {
+                out.csvField(diskfile) << ',' << track << ',' << free << ',' << map << '\n';
             }
-            std::cout << '\n';
+            else {
+                out.pad(track, 4) << ' ' << map << '\n';
+            }
+        }
+
+        if (out.json()) {
+            out << "]}\n";
         }
+        out.flush();
     }
     else {
         std::cerr << "Error: Could not load disk.\n";
@@ -179,78 +301,302 @@ void handleBAM(const std::string& diskfile)
 }
 
 /// <summary>
-/// Add a file to a d64 disk image
+/// Read a stream to its end without seeking
 /// </summary>
-/// <param name="diskfile">diskfile to use</param>
-/// <param name="filename">file to add</param>
-void handleAdd(const std::string& diskfile, const std::string& filename)
+/// <param name="in">stream to read</param>
+/// <param name="fileData">gets the contents</param>
+/// <returns>true on success</returns>
+bool readStream(std::istream& in, std::vector<uint8_t>& fileData)
 {
-    d64 disk;
-    diskname = diskfile;
+    const size_t CHUNK = 64 * 1024;
+    fileData.clear();
+    while (in.good()) {
+        auto used = fileData.size();
+        fileData.resize(used + CHUNK);
+        in.read(reinterpret_cast<char*>(fileData.data() + used), CHUNK);
+        fileData.resize(used + static_cast<size_t>(in.gcount()));
+    }
+    return in.eof() && !in.bad();
+}
 
-    // open the disk file
-    if (disk.load(diskname)) {
+/// <summary>
+/// Read a host file.
+/// - reads stdin, pipes and devices are read to their end.
+/// </summary>
+/// <param name="filename">file to read</param>
+/// <param name="fileData">gets the contents</param>
+/// <returns>true on success</returns>
+bool readHostFile(const std::string& filename, std::vector<uint8_t>& fileData)
+{
+    auto ok = false;
+    if (filename == "-") {
+        ok = readStream(std::cin, fileData);
+    }
+    else {
         std::ifstream fs(filename, std::ios::binary);
         if (!fs.is_open()) {
-            std::cerr << "Error: unable to open file " << filename << ".\n";
-            return;
+            return false;
+        }
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(filename, ec)) {
+            ok = readStream(fs, fileData);
         }
-        fs.seekg(0, std::ios::end);
-        auto length = fs.tellg();
+        else {
+            fs.seekg(0, std::ios::end);
+            auto length = fs.tellg();
 
-        fs.seekg(0, std::ios::beg);
-        std::vector<uint8_t> fileData(length);
-        fs.read((char*)&fileData[0], length);
-        fs.close();
+            fs.seekg(0, std::ios::beg);
+            fileData.resize(length);
+            fs.read((char*)fileData.data(), length);
+            ok = fs.good() || fs.eof();
+        }
+    }
+    if (ok) {
+        countHostRead(fileData.size());
+    }
+    return ok;
+}
 
-        // get the name part of the filename
-        // convert to upper case and remove extension 
-        auto name = filename;
-        auto index = static_cast<int>(name.size()) - 1;
-        auto endindex = 0;
-        while (index >= 0) {
-            name[index] = toupper(name[index]);
-            if (endindex == 0) {
-                if (name[index] == '.') {
-                    endindex = index--;
-                    continue;
+/// <summary>
+/// Get the name part of a host file name
+/// converted to upper case without extension
+/// </summary>
+/// <param name="filename">host file name</param>
+/// <param name="extension">gets the upper case extension including the dot</param>
+/// <returns>name for the disk</returns>
+std::string cbmFileName(const std::string& filename, std::string& extension)
+{
+    auto name = filename;
+    auto index = static_cast<int>(name.size()) - 1;
+    auto endindex = 0;
+    while (index >= 0) {
+        name[index] = toupper(name[index]);
+        if (endindex == 0) {
+            if (name[index] == '.') {
+                endindex = index--;
+                continue;
+            }
+        }
+        if (ispunct(name[index])) {
+            break;
+        }
+        --index;
+    }
+
+    extension = (endindex == 0) ? "" : name.substr(endindex);
+    return (endindex == 0) ? name.substr(index + 1) : name.substr(index + 1, (endindex - 1) - index);
+}
+
+/// <summary>
+/// Match a name against a pattern with * and ? wildcards
+/// </summary>
+/// <param name="pattern">pattern</param>
+/// <param name="text">name to test</param>
+/// <returns>true if the name matches</returns>
+bool wildcardMatch(const std::string& pattern, const std::string& text)
+{
+    size_t p = 0, t = 0;
+    size_t star = std::string::npos, mark = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+            ++p;
+            ++t;
+        }
+        else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = t;
+        }
+        else if (star != std::string::npos) {
+            p = star + 1;
+            t = ++mark;
+        }
+        else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+/// <summary>
+/// Expand directories and wildcard patterns to a list of host files
+/// </summary>
+/// <param name="patterns">files, directories or patterns like demo/*.prg</param>
+/// <returns>files in the order given, directory contents sorted by name</returns>
+std::vector<std::string> expandHostFiles(const std::vector<std::string>& patterns)
+{
+    namespace fs = std::filesystem;
+    std::vector<std::string> files;
+
+    for (const auto& pattern : patterns) {
+        std::error_code ec;
+        std::vector<std::string> found;
+        fs::path path(pattern);
+        auto wildcard = path.filename().string().find_first_of("*?") != std::string::npos;
+
+        if (!wildcard && fs::is_directory(path, ec)) {
+            for (const auto& entry : fs::directory_iterator(path, ec)) {
+                if (entry.is_regular_file(ec)) {
+                    found.push_back(entry.path().string());
                 }
             }
-            if (ispunct(name[index])) {
-                break;
+        }
+        else if (wildcard) {
+            auto dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+            for (const auto& entry : fs::directory_iterator(dir, ec)) {
+                if (entry.is_regular_file(ec) && wildcardMatch(path.filename().string(), entry.path().filename().string())) {
+                    found.push_back(path.has_parent_path() ? entry.path().string() : entry.path().filename().string());
+                }
             }
-            --index;
         }
+        else {
+            files.push_back(pattern);
+            continue;
+        }
+
+        if (found.empty()) {
+            std::cerr << "Error: no files match " << pattern << ".\n";
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+/// <summary>
+/// Parse a file type given on the command line
+/// </summary>
+/// <param name="text">prg, seq or usr</param>
+/// <param name="type">gets the type</param>
+/// <returns>false if the type is not known</returns>
+bool parseFileType(std::string text, FileTypes& type)
+{
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    if (text == "prg") type = FileTypes::PRG;
+    else if (text == "seq") type = FileTypes::SEQ;
+    else if (text == "usr") type = FileTypes::USR;
+    else return false;
+    return true;
+}
+
+/// <summary>
+/// A host file to add to a disk
+/// </summary>
+struct HostFile {
+    std::string path;
+    std::string name;
+    FileTypes type = FileTypes::PRG;
+    bool valid = false;
+    std::vector<uint8_t> data;
+};
+
+/// <summary>
+/// Add files to a d64 disk image.
+/// The host files are read concurrently, the free space is checked
+/// for all of them and the disk is saved once.
+/// - adds stdin as the file named by --name with the type from --type.
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="filenames">files, directories or wildcard patterns to add</param>
+void handleAdd(const std::string& diskfile, const std::vector<std::string>& filenames)
+{
+    diskname = diskfile;
 
-        FileTypes filetype;
-        if (name.ends_with(".PRG"))
-            filetype = FileTypes::PRG;
-        else if (name.ends_with(".SEQ"))
-            filetype = FileTypes::SEQ;
-        else if (name.ends_with(".USR"))
-            filetype = FileTypes::USR;
-        else if (name.ends_with(".REL")) {
+    // open the disk file
+    auto image = sessions.open(diskname);
+    if (!image) {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+        return;
+    }
+    auto& disk = image->disk();
+
+    std::vector<HostFile> files;
+    std::unordered_set<std::string> names;
+    for (const auto& filename : expandHostFiles(filenames)) {
+        HostFile file;
+        file.path = filename;
+
+        std::string extension;
+        file.name = cbmFileName(filename, extension);
+        if (filename == "-") {
+            if (stdinCommands || !std::cin.good()) {
+                std::cerr << "Error: stdin is not available for file data.\n";
+                continue;
+            }
+            if (!program.is_used("--name")) {
+                std::cerr << "Error: --name is required to add stdin.\n";
+                continue;
+            }
+            file.name = program.get<std::string>("--name");
+            std::transform(file.name.begin(), file.name.end(), file.name.begin(), ::toupper);
+            if (program.is_used("--type") && !parseFileType(program.get<std::string>("--type"), file.type)) {
+                std::cerr << "Error: Invalid value for --type. Expecting prg, seq or usr.\n";
+                continue;
+            }
+        }
+        else if (extension == ".PRG")
+            file.type = FileTypes::PRG;
+        else if (extension == ".SEQ")
+            file.type = FileTypes::SEQ;
+        else if (extension == ".USR")
+            file.type = FileTypes::USR;
+        else if (extension == ".REL") {
             std::cerr << "Error: Use addrel to add .rel files.\n";
-            return;
+            continue;
         }
         else {
             std::cerr << "Error: Unknown file type. Using .PRG.\n";
-            filetype = FileTypes::PRG;
+            file.type = FileTypes::PRG;
         }
-        
-        name = (endindex == 0) ? name.substr(index + 1) : name.substr(index + 1, (endindex - 1) - index);
-        if (disk.addFile(name, filetype, fileData)) {
-            disk.save(diskfile);
-            std::cout << "Added file: " << filename << " to " << disk.diskname() << "\n";
+        if (image->exists(file.name) || !names.insert(file.name).second) {
+            std::cerr << "Error: File " << file.name << " already exists.\n";
+            continue;
+        }
+        files.push_back(std::move(file));
+    }
+    if (files.empty()) {
+        return;
+    }
+
+    {
+        PhaseTimer timer(host_io_phase);
+        parallelFor(files.size(), [&](size_t i) {
+            files[i].valid = readHostFile(files[i].path, files[i].data);
+        });
+    }
+
+    auto blocks = 0;
+    for (const auto& file : files) {
+        if (!file.valid) {
+            std::cerr << "Error: unable to open file " << file.path << ".\n";
+            return;
+        }
+        blocks += fileBlocks(file.data.size());
+    }
+
+    auto freeBlocks = image->index().freeBlocks();
+    auto freeSlots = image->index().freeSlots();
+    if (blocks > freeBlocks || static_cast<int>(files.size()) > freeSlots) {
+        std::cerr << "Error: " << files.size() << " files need " << blocks << " blocks, disk has "
+            << freeBlocks << " blocks and " << freeSlots << " directory entries free.\n";
+        return;
+    }
+
+    auto added = 0;
+    for (const auto& file : files) {
+        if (image->addFile(file.name, file.type, file.data)) {
+            std::cout << "Added file: " << file.path << " to " << disk.diskname() << "\n";
+            ++added;
         }
         else {
-            std::cerr << "Error: Failed to add file.\n";
-            diskname.clear();
+            std::cerr << "Error: Failed to add file " << file.path << ".\n";
         }
     }
-    else {
-        std::cerr << "Error: Could not load disk.\n";
-        diskname.clear();
+    if (added > 0) {
+        image->commit();
     }
 }
 
@@ -262,48 +608,27 @@ void handleAdd(const std::string& diskfile, const std::string& filename)
 /// <param name="recordsize">record sie</param>
 void handleAddRel(const std::string& diskfile, const std::string& filename, const int recordsize)
 {
-    d64 disk;
     diskname = diskfile;
 
     // open the disk file
-    if (disk.load(diskname)) {
-        std::ifstream fs(filename, std::ios::binary);
-        if (!fs.is_open()) {
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
+        std::vector<uint8_t> fileData;
+        if (!readHostFile(filename, fileData)) {
             std::cerr << "Error: unable to open file " << filename << ".\n";
             return;
         }
-        fs.seekg(0, std::ios::end);
-        auto length = fs.tellg();
-
-        fs.seekg(0, std::ios::beg);
-        std::vector<uint8_t> fileData(length);
-        fs.read((char*)&fileData[0], length);
-        fs.close();
 
         // get the name part of the filename
         // convert to upper case and remove extension 
-        auto name = filename;
-        auto index = static_cast<int>(name.size()) - 1;
-        auto endindex = 0;
-        while (index >= 0) {
-            name[index] = toupper(name[index]);
-            if (endindex == 0) {
-                if (name[index] == '.') {
-                    endindex = index--;
-                    continue;
-                }
-            }
-            if (ispunct(name[index])) {
-                break;
-            }
-            --index;
-        }
-
+        std::string extension;
+        auto name = cbmFileName(filename, extension);
         auto filetype = FileTypes::REL;
 
-        name = (endindex == 0) ? name.substr(index + 1) : name.substr(index + 1, (endindex - 1) - index);
         if (disk.addRelFile(name, filetype, recordsize, fileData)) {
-            disk.save(diskfile);
+            image->invalidate();
+            image->commit();
             std::cout << "Added file: " << filename << " to " << disk.diskname() << "\n";
         }
         else {
@@ -317,43 +642,64 @@ void handleAddRel(const std::string& diskfile, const std::string& filename, cons
     }
 }
 
+/// <summary>
+/// Three letter name of a file type
+/// </summary>
+/// <param name="type">file type from the directory entry</param>
+/// <returns>PRG, SEQ, USR, REL, DEL or ???</returns>
+const char* fileTypeName(uint8_t type)
+{
+    switch (type) {
+        case FileTypes::PRG: return "PRG";
+        case FileTypes::SEQ: return "SEQ";
+        case FileTypes::USR: return "USR";
+        case FileTypes::REL: return "REL";
+        case FileTypes::DEL: return "DEL";
+        default: return "???";
+    }
+}
+
 /// <summary>
 /// List files on the a d64 disk image
 /// </summary>
 /// <param name="diskfile">diskfile to use</param>
 void handleList(const std::string& diskfile)
 {
-    d64 disk;
+    D64View disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
-        std::cout << "Directory of " << disk.diskname() << "\n";
-        std::cout << disk.getFreeSectorCount() << " free sectors\n";
-        for (const auto& entry : disk.directory()) {
-            std::cout << std::setw(15) << d64::Trim(entry.file_name) << (entry.file_type.locked ? "< " : "  ");
-
-            uint8_t type = entry.file_type.type;
-            switch (type) {
-                case FileTypes::PRG:
-                    std::cout << "PRG";
-                    break;
-                case FileTypes::SEQ:
-                    std::cout << "SEQ";
-                    break;
-                case FileTypes::USR:
-                    std::cout << "USR";
-                    break;
-                case FileTypes::REL:
-                    std::cout << "REL";
-                    break;
-                case FileTypes::DEL:
-                    std::cout << "DEL";
-                    break;
-                default:
-                    std::cout << "???";
+    if (openView(disk, diskname)) {
+        OutputBuffer out(outputFormat);
+        auto entries = disk.directory();
+
+        if (out.json()) {
+            out << "{\"disk\":";
+            out.jsonString(diskfile) << ",\"name\":";
+            out.jsonString(disk.diskname()) << ",\"free\":" << disk.freeSectorCount() << ",\"files\":[";
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const auto& entry = entries[i];
+                out << (i > 0 ? "," : "") << "{\"name\":";
+                out.jsonString(entry.name()) << ",\"type\":\"" << fileTypeName(entry.type()) << "\",\"locked\":";
+                out.boolean(entry.locked()) << ",\"blocks\":" << entry.blocks() << "}";
+            }
+            out << "]}\n";
+        }
+        else if (out.csv()) {
+            out << "image,name,type,locked,blocks\n";
+            for (const auto& entry : entries) {
+                out.csvField(diskfile) << ',';
+                out.csvField(entry.name()) << ',' << fileTypeName(entry.type()) << ',' << (entry.locked() ? "1" : "0") << ',' << entry.blocks() << '\n';
             }
-            std::cout << " " << entry.file_size[0] + entry.file_size[1] * 256 << " sectors\n";
         }
+        else {
+            out << "Directory of " << disk.diskname() << "\n";
+            out << disk.freeSectorCount() << " free sectors\n";
+            for (const auto& entry : entries) {
+                out.pad(entry.name(), 15) << (entry.locked() ? "< " : "  ");
+                out << fileTypeName(entry.type()) << " " << entry.blocks() << " sectors\n";
+            }
+        }
+        out.flush();
     }
     else {
         std::cerr << "Error: Could not load disk.\n";
@@ -368,12 +714,13 @@ void handleList(const std::string& diskfile)
 /// <param name="filename">file to lock</param>
 void handleLock(const std::string& diskfile, const std::string& filename)
 {
-    d64 disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
         if (disk.lockfile(filename, true)) {
-            disk.save(diskfile);
+            image->commit();
             std::cout << "Locked file: " << filename << " from " << disk.diskname() << "\n";
         }
         else {
@@ -393,12 +740,13 @@ void handleLock(const std::string& diskfile, const std::string& filename)
 /// <param name="filename">file to extract</param>
 void handleUnlock(const std::string& diskfile, const std::string& filename)
 {
-    d64 disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
         if (disk.lockfile(filename, true)) {
-            disk.save(diskfile);
+            image->commit();
             std::cout << "Unlocked file: " << filename << " from " << disk.diskname() << "\n";
         }
         else {
@@ -412,144 +760,514 @@ void handleUnlock(const std::string& diskfile, const std::string& filename)
 }
 
 /// <summary>
-/// Display a sector
+/// Parse a track range
 /// </summary>
-/// <param name="diskfile">diskfile to use</param>
-/// <param name="track">track to use</param>
-/// <param name="sector">sector to use</param>
-void handleDumpSector(const std::string& diskfile, int track, int sector)
+/// <param name="text">a track, first-last or all</param>
+/// <param name="tracks">tracks of the disk</param>
+/// <param name="first">gets the first track</param>
+/// <param name="last">gets the last track</param>
+/// <returns>false if the range is not on the disk</returns>
+bool parseTrackRange(const std::string& text, int tracks, int& first, int& last)
 {
-    d64 disk;
-    diskname = diskfile;
+    if (text.empty() || text == "all") {
+        first = 1;
+        last = tracks;
+        return true;
+    }
+    auto dash = text.find('-');
+    first = std::atoi(text.substr(0, dash).c_str());
+    last = (dash == std::string::npos) ? first : std::atoi(text.substr(dash + 1).c_str());
+    return first >= 1 && first <= last && last <= tracks;
+}
+
+/// <summary>
+/// Format sectors of a disk into one buffer
+/// </summary>
+/// <param name="disk">disk to dump</param>
+/// <param name="diskfile">name of the disk for the output</param>
+/// <param name="first">first track</param>
+/// <param name="last">last track</param>
+/// <param name="sector">sector to dump, -1 for all sectors of the tracks</param>
+/// <param name="out">output in the selected format</param>
+/// <returns>false if a sector could not be read</returns>
+bool dumpSectors(const D64View& disk, const std::string& diskfile, int first, int last, int sector, OutputBuffer& out)
+{
+    // a single sector keeps the layout of one dump
+    auto single = first == last && sector >= 0;
+
+    size_t sectors = 0;
+    for (auto track = first; track <= last; ++track) {
+        sectors += sector >= 0 ? 1 : sectorsPerTrack(track);
+    }
+    out.reserve(sectors * (out.csv() ? 16 * (diskfile.size() + 48) : 1280));
+
+    if (out.json() && !single) {
+        out << "{\"disk\":";
+        out.jsonString(diskfile) << ",\"sectors\":[";
+    }
+    if (out.csv()) {
+        out << "image,track,sector,offset,hex\n";
+    }
 
-    if (disk.load(diskname)) {
-        auto data = disk.readSector(track, sector);
-        if (data.has_value()) {
-            std::cout << "TRACK " << track << " SECTOR " << sector << '\n';
-            auto b = 0;
-            std::string ascii;
-            for (auto& byte : data.value()) {
-                if (b % 16 == 0) {
-                    std::cout << std::setw(10) << std::setfill(' ') << ' ' << ascii << "\n";
-                    ascii.clear();
+    auto count = 0;
+    for (auto track = first; track <= last; ++track) {
+        auto from = sector >= 0 ? sector : 0;
+        auto to = sector >= 0 ? sector : sectorsPerTrack(track) - 1;
+        for (auto s = from; s <= to; ++s) {
+            auto data = disk.sector(track, s);
+            if (data.empty()) {
+                std::cerr << "Error: Could not read track " << track << " sector " << s << ".\n";
+                return false;
+            }
+
+            if (out.json()) {
+                if (single) {
+                    out << "{\"disk\":";
+                    out.jsonString(diskfile) << ",\"track\":" << track << ",\"sector\":" << s << ",\"data\":\"";
+                    out.hex(data.data(), data.size()) << "\"}\n";
+                }
+                else {
+                    out << (count++ ? ",\n" : "\n") << "{\"track\":" << track << ",\"sector\":" << s << ",\"data\":\"";
+                    out.hex(data.data(), data.size()) << "\"}";
                 }
-                ascii += isprint(byte) ? static_cast<char>(byte) : '.';
-                std::cout << std::setw(2) << std::setfill('0') << std::hex << static_cast<int>(byte) << ' ';
-                b++;
             }
-            std::cout << std::setw(10) << std::setfill(' ') << ' ' << ascii << "\n" <<
-                std::setw(0) << std::dec << std::setfill(' ');
-        }
-        else {
-            std::cerr << "Error: Could not read track " << track << " sector " << sector << ".\n";
+            else if (out.csv()) {
+                for (size_t offset = 0; offset < data.size(); offset += 16) {
+                    out.csvField(diskfile) << ',' << track << ',' << s << ',' << static_cast<int>(offset) << ',';
+                    out.hex(data.data() + offset, 16) << '\n';
+                }
+            }
+            else {
+                out << "TRACK " << track << " SECTOR " << s << "\n          \n";
+                out.hexDump(data.data(), data.size());
+            }
         }
     }
-    else {
-        std::cerr << "Error: Could not load disk.\n";
-        diskname.clear();
+
+    if (out.json() && !single) {
+        out << "\n]}\n";
     }
+    return true;
 }
 
 /// <summary>
-/// Extract a file from a d64 disk image
+/// Display a sector, the sectors of a track range or the whole disk
 /// </summary>
 /// <param name="diskfile">diskfile to use</param>
-/// <param name="filename">file to extract</param>
-void handleExtract(const std::string& diskfile, const std::string& filename)
+/// <param name="args">track, first-last or all (default), optional sector of a single track</param>
+void handleDump(const std::string& diskfile, const std::vector<std::string>& args)
 {
-    d64 disk;
+    D64View disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
-        if (disk.extractFile(filename)) {
-            std::cout << "Extracted file: " << filename << " from " << disk.diskname() << "\n";
-        }
-        else {
-            std::cerr << "Error: Could not extract file.\n";
-        }
-    }
-    else {
+    if (!openView(disk, diskname)) {
         std::cerr << "Error: Could not load disk.\n";
         diskname.clear();
+        return;
+    }
+
+    int first, last;
+    if (!parseTrackRange(args.empty() ? "" : args[0], disk.tracks(), first, last)) {
+        std::cerr << "Error: Invalid track " << args[0] << ". Expecting a track, first-last or all.\n";
+        return;
+    }
+    auto sector = -1;
+    if (args.size() > 1) {
+        if (first != last) {
+            std::cerr << "Error: A sector can only be given for a single track.\n";
+            return;
+        }
+        sector = std::atoi(args[1].c_str());
+    }
+
+    OutputBuffer out(outputFormat);
+    if (dumpSectors(disk, diskfile, first, last, sector, out)) {
+        out.flush();
     }
 }
 
 /// <summary>
-/// Remove a file from a d64 disk image
+/// Match a file name against a CBM DOS pattern.
+/// ? matches any character, * matches the rest of the name.
 /// </summary>
-/// <param name="diskfile">diskfile to use</param>
-/// <param name="filename">file to remove</param>
-void handleRemove(const std::string& diskfile, const std::string& filename)
+/// <param name="pattern">pattern</param>
+/// <param name="name">file name on the disk</param>
+/// <returns>true if the name matches</returns>
+bool cbmMatch(const std::string& pattern, const std::string& name)
 {
-    d64 disk;
-    diskname = diskfile;
-
-    if (disk.load(diskname)) {
-        if (disk.removeFile(filename)) {
-            disk.save(diskfile);
-            std::cout << "Removed file: " << filename << " from " << disk.diskname() << "\n";
-        }
-        else {
-            std::cerr << "Error: Could not remove file.\n";
-        }
+    size_t i = 0;
+    for (; i < pattern.size(); ++i) {
+        if (pattern[i] == '*') return true;
+        if (i >= name.size()) return false;
+        if (pattern[i] != '?' && pattern[i] != name[i]) return false;
     }
-    else {
-        std::cerr << "Error: Could not load disk.\n";
-        diskname.clear();
-    } 
+    return i == name.size();
 }
 
 /// <summary>
-/// Rename a file on a d64 disk image
+/// Make a disk file name safe to use as a host file name
 /// </summary>
-/// <param name="diskfile">diskfile to use</param>
-/// <param name="oldname">file to rename</param>
-/// <param name="newname">new name of file</param>
-void handleRename(const std::string& diskfile, const std::string& oldname, const std::string& newname)
+/// <param name="name">file name on the disk</param>
+/// <returns>host file name</returns>
+std::string hostFileName(const std::string& name)
 {
-    d64 disk;
-    diskname = diskfile;
-
-    if (disk.load(diskname)) {
-        if (disk.renameFile(oldname, newname)) {
-            disk.save(diskfile);
-            std::cout << "Renamed file: " << oldname << " => " << newname << "\n";
-        }
-        else {
-            std::cerr << "Error: Could not rename file.\n";
-        }
+    std::string hostname;
+    for (auto ch : name) {
+        auto c = static_cast<unsigned char>(ch);
+        hostname += (isalnum(c) || c == ' ' || c == '-' || c == '.' || c == '+') && c < 0x80 ? ch : '_';
     }
-    else {
-        std::cerr << "Error: Could not load disk.\n";
-        diskname.clear();
+    while (!hostname.empty() && (hostname.back() == ' ' || hostname.back() == '.')) {
+        hostname.pop_back();
+    }
+    if (hostname.empty() || hostname == "." || hostname == "..") {
+        hostname = "_";
     }
+    return hostname;
 }
 
 /// <summary>
-/// Verify a disk and optionally fix it
+/// Extract files from a d64 disk image.
+/// A single name is extracted by the library under the host name it
+/// always used. For a pattern or --outdir the sector chains are
+/// decoded and written to the host on a pool of threads.
 /// </summary>
 /// <param name="diskfile">diskfile to use</param>
-/// <param name="fix">true to auto fix errors</param>
-void handleVerify(const std::string& diskfile, bool fix)
+/// <param name="filename">file or pattern to extract, * for all files</param>
+void handleExtract(const std::string& diskfile, const std::string& filename)
 {
-    d64 disk;
+    D64View disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
-        bool valid = disk.verifyBAMIntegrity(fix, "");
-        if (valid) {
-            std::cout << "BAM integrity check passed.\n";
+    // a single file keeps the host name the library has always given it
+    if (filename.find_first_of("*?") == std::string::npos && !program.is_used("--outdir")) {
+        d64 loaded;
+        auto image = sessions.find(diskname);
+        if (!image && !loadImage(loaded, diskname)) {
+            std::cerr << "Error: Could not load disk.\n";
+            diskname.clear();
+            return;
+        }
+        auto& source = image ? image->disk() : loaded;
+        PhaseTimer timer(host_io_phase);
+        if (source.extractFile(filename)) {
+            std::cout << "Extracted file: " << filename << " from " << source.diskname() << "\n";
         }
         else {
-            std::cerr << "Errors found in BAM.\n";
+            std::cerr << "Error: Could not extract file.\n";
         }
-        if (fix) disk.save(diskfile);
+        return;
     }
-    else {
+
+    if (!openView(disk, diskname)) {
         std::cerr << "Error: Could not load disk.\n";
         diskname.clear();
+        return;
     }
-}
+
+    std::filesystem::path outdir(program.is_used("--outdir") ? program.get<std::string>("--outdir") : ".");
+    std::error_code ec;
+    std::filesystem::create_directories(outdir, ec);
+
+    // one pass over the directory picks the files and their host names
+    struct Extraction {
+        DirEntryView entry;
+        std::string name;
+        std::filesystem::path target;
+        bool ok = false;
+    };
+    std::vector<Extraction> files;
+    std::map<std::string, int> used;
+    for (const auto& entry : disk.directory()) {
+        auto name = entry.name();
+        if (!cbmMatch(filename, name)) continue;
+
+        auto hostname = hostFileName(name);
+        if (used[hostname]++ > 0) {
+            hostname += "~" + std::to_string(used[hostname] - 1);
+        }
+        files.push_back({ entry, name, outdir / hostname });
+    }
+
+    if (files.empty()) {
+        std::cerr << "Error: Could not extract file.\n";
+        return;
+    }
+
+    {
+        PhaseTimer timer(host_io_phase);
+        parallelFor(files.size(), [&](size_t i) {
+            auto data = disk.readFile(files[i].entry);
+            if (!data.has_value()) return;
+
+            std::ofstream out(files[i].target, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(data->data()), data->size());
+            files[i].ok = out.good();
+            if (files[i].ok) {
+                countHostWritten(data->size());
+            }
+        });
+    }
+
+    for (const auto& file : files) {
+        if (file.ok) {
+            std::cout << "Extracted file: " << file.name << " from " << disk.diskname() << "\n";
+        }
+        else {
+            std::cerr << "Error: Could not extract file " << file.name << ".\n";
+        }
+    }
+}
+
+/// <summary>
+/// Write one file of a d64 disk image to stdout
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="filename">file or pattern matching a single file</param>
+void extractToStdout(const std::string& diskfile, const std::string& filename)
+{
+    D64View disk;
+    diskname = diskfile;
+
+    if (!openView(disk, diskname)) {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+        return;
+    }
+
+    std::vector<DirEntryView> found;
+    for (const auto& entry : disk.directory()) {
+        if (cbmMatch(filename, entry.name())) {
+            found.push_back(entry);
+        }
+    }
+    if (found.size() != 1) {
+        std::cerr << "Error: Could not extract file" << (found.empty() ? "" : ", " + std::to_string(found.size()) + " files match") << ".\n";
+        return;
+    }
+
+    auto data = disk.readFile(found[0]);
+    if (!data.has_value()) {
+        std::cerr << "Error: Could not extract file " << found[0].name() << ".\n";
+        return;
+    }
+    PhaseTimer timer(host_io_phase);
+    std::cout.write(reinterpret_cast<const char*>(data->data()), data->size());
+    std::cout.flush();
+    countHostWritten(data->size());
+}
+
+/// <summary>
+/// Extract files, to stdout if the target is -
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="args">file or pattern, optional target</param>
+void handleExtractList(const std::string& diskfile, const std::vector<std::string>& args)
+{
+    if (args.empty()) {
+        std::cerr << "Error: Missing parameters for command extract\n";
+    }
+    else if (args.size() > 1 && args[1] == "-") {
+        extractToStdout(diskfile, args[0]);
+    }
+    else {
+        handleExtract(diskfile, args[0]);
+    }
+}
+
+/// <summary>
+/// Remove a file from a d64 disk image
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="filename">file to remove</param>
+void handleRemove(const std::string& diskfile, const std::string& filename)
+{
+    diskname = diskfile;
+
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
+        if (image->removeFile(filename)) {
+            image->commit();
+            std::cout << "Removed file: " << filename << " from " << disk.diskname() << "\n";
+        }
+        else {
+            std::cerr << "Error: Could not remove file.\n";
+        }
+    }
+    else {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+    } 
+}
+
+/// <summary>
+/// Rename a file on a d64 disk image
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="oldname">file to rename</param>
+/// <param name="newname">new name of file</param>
+void handleRename(const std::string& diskfile, const std::string& oldname, const std::string& newname)
+{
+    diskname = diskfile;
+
+    auto image = sessions.open(diskname);
+    if (image) {
+        if (image->renameFile(oldname, newname)) {
+            image->commit();
+            std::cout << "Renamed file: " << oldname << " => " << newname << "\n";
+        }
+        else {
+            std::cerr << "Error: Could not rename file.\n";
+        }
+    }
+    else {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+    }
+}
+
+/// <summary>
+/// Verify a disk and optionally fix it
+/// </summary>
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="fix">true to auto fix errors</param>
+void handleVerify(const std::string& diskfile, bool fix)
+{
+    diskname = diskfile;
+
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
+        auto valid = true, fixed = false;
+        if (fix) {
+            // the repair is counted as a fix only if it changed the image
+            VerifyReport report;
+            if (checkImage(disk, report)) {
+                image->invalidate();
+                fixed = image->commit();
+            }
+            valid = report.valid;
+        }
+        else {
+            valid = disk.verifyBAMIntegrity(false, "");
+        }
+        OutputBuffer out(outputFormat);
+        if (out.json()) {
+            out << "{\"disk\":";
+            out.jsonString(diskfile) << ",\"valid\":";
+            out.boolean(valid) << ",\"fixed\":";
+            out.boolean(fixed) << "}\n";
+        }
+        else if (out.csv()) {
+            out << "image,valid,fixed\n";
+            out.csvField(diskfile) << ',' << (valid ? "1" : "0") << ',' << (fixed ? "1" : "0") << '\n';
+        }
+        else if (valid) {
+            out << "BAM integrity check passed.\n";
+        }
+        else {
+            std::cerr << "Errors found in BAM.\n";
+        }
+        out.flush();
+    }
+    else {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+    }
+}
+
+/// <summary>
+/// Verify many disks on a pool of threads and print one summary
+/// </summary>
+/// <param name="patterns">image files, directories or wildcard patterns</param>
+/// <param name="fix">true to fix and save images with errors</param>
+/// <returns>true if every image is valid</returns>
+bool verifyDisks(const std::vector<std::string>& patterns, bool fix)
+{
+    // images are read from their files
+    flushSessions();
+
+    std::vector<std::string> images;
+    for (const auto& pattern : patterns) {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(pattern, ec)) {
+            auto found = expandHostFiles({ pattern });
+            images.insert(images.end(), found.begin(), found.end());
+            continue;
+        }
+
+        // the raw and compressed images of a directory
+        std::vector<std::string> found;
+        for (const auto& entry : std::filesystem::directory_iterator(pattern, ec)) {
+            if (entry.is_regular_file(ec) && isImageName(entry.path().string())) {
+                found.push_back(entry.path().string());
+            }
+        }
+        if (found.empty()) {
+            std::cerr << "Error: no images in " << pattern << ".\n";
+        }
+        std::sort(found.begin(), found.end());
+        images.insert(images.end(), found.begin(), found.end());
+    }
+
+    auto reports = verifyImages(images, fix, lockTimeout);
+    for (const auto& report : reports) {
+        if (report.fixed) {
+            sessions.close(report.path);
+        }
+    }
+
+    OutputBuffer out(outputFormat);
+    printVerify(reports, out);
+    out.flush();
+    return std::all_of(reports.begin(), reports.end(), [](const VerifyReport& report) { return report.ok(); });
+}
+
+/// <summary>
+/// Split the arguments of an interactive verify into the images
+/// and the fix flag, given as true or --fix
+/// </summary>
+/// <param name="args">arguments, an empty one for no current disk</param>
+/// <param name="patterns">gets the images, directories and patterns</param>
+/// <returns>true to fix errors</returns>
+bool verifyArguments(const std::vector<std::string>& args, std::vector<std::string>& patterns)
+{
+    auto fix = false;
+    patterns.clear();
+    for (const auto& arg : args) {
+        if (arg == "true" || arg == "--fix") {
+            fix = true;
+        }
+        else if (!arg.empty()) {
+            patterns.push_back(arg);
+        }
+    }
+    return fix;
+}
+
+/// <summary>
+/// Verify one disk, or many disks when more than one image,
+/// a directory or a wildcard pattern is given
+/// </summary>
+/// <param name="diskfile">image, directory or pattern</param>
+/// <param name="args">more images, true to fix errors</param>
+void handleVerifyList(const std::string& diskfile, const std::vector<std::string>& args)
+{
+    std::vector<std::string> patterns;
+    auto fix = verifyArguments(args, patterns);
+    if (!diskfile.empty()) {
+        patterns.insert(patterns.begin(), diskfile);
+    }
+
+    std::error_code ec;
+    if (patterns.size() == 1 && patterns[0].find_first_of("*?") == std::string::npos &&
+        !std::filesystem::is_directory(patterns[0], ec)) {
+        handleVerify(patterns[0], fix);
+    }
+    else {
+        verifyDisks(patterns, fix);
+    }
+}
 
 /// <summary>
 /// compact a disk
@@ -557,12 +1275,14 @@ void handleVerify(const std::string& diskfile, bool fix)
 /// <param name="diskfile">diskfile to use</param>
 void handleCompact(const std::string& diskfile)
 {
-    d64 disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
         if (disk.compactDirectory()) {
-            disk.save(diskfile);
+            image->invalidate();
+            image->commit();
             std::cout << "Compacted directory.\n";
         }
         else {
@@ -582,22 +1302,23 @@ void handleCompact(const std::string& diskfile)
 /// <param name="order">order of new files. If there are files not on the list they are put at the end</param>
 void handleReorder(const std::string& diskfile, const std::vector<std::string>& order)
 {
+    auto fileOrder = order;
     if (program.is_used("--orderfile")) {
         std::ifstream orderFile(program.get<std::string>("--orderfile"));
-        std::vector<std::string> fileOrder;
         std::string line;
         while (std::getline(orderFile, line)) {
             fileOrder.push_back(line);
         }
-        handleReorder(program.get<std::string>("diskfile"), fileOrder);
     }
 
-    d64 disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
-        if (disk.reorderDirectory(order)) {
-            disk.save(diskfile);
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
+        if (disk.reorderDirectory(fileOrder)) {
+            image->invalidate();
+            image->commit();
             std::cout << "Reordered files on disk.\n";
         }
         else {
@@ -617,12 +1338,13 @@ void handleReorder(const std::string& diskfile, const std::vector<std::string>&
 /// <param name="newname">name name for disk</param>
 void handleDiskRename(const std::string& diskfile, const std::string& newname)
 {
-    d64 disk;
     diskname = diskfile;
 
-    if (disk.load(diskname)) {
+    auto image = sessions.open(diskname);
+    if (image) {
+        auto& disk = image->disk();
         if (disk.rename_disk(newname)) {
-            disk.save(diskfile);
+            image->commit();
             std::cout << "Renamed disk " << disk.diskname() << "\n";
         }
         else {
@@ -636,162 +1358,396 @@ void handleDiskRename(const std::string& diskfile, const std::string& newname)
 }
 
 /// <summary>
-/// Load 2 disks in memory
-/// and determine if they loaded correctly
+/// backup disks
 /// </summary>
-/// <param name="sourceDisk">gets the source disk</param>
-/// <param name="targetDisk">gets the target disk</param>
-/// <param name="source">source disk name</param>
-/// <param name="target">target disk name</param>
-/// <returns>true on success</returns>
-bool loadDisks(d64& sourceDisk, d64& targetDisk, const std::string& source, const std::string& target)
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="disks">disks to backup files from</param>
+/// <returns>true if every file was backed up</returns>
+bool backupImages(const std::string& diskfile, const std::vector<std::string>& disks)
 {
-    auto source_valid = sourceDisk.load(source);
-    auto dest_valid = targetDisk.load(target);
+    // backup reads and writes image files directly
+    flushSessions();
+    sessions.clear();
 
-    if (!source_valid || !dest_valid) {
-        std::cerr << "Error: Failed to load one or both disks.\n";
-        return false;
+    conformation = skip_file;
+    BackupOptions options;
+    options.dryRun = program.get<bool>("--dry-run");
+    options.lockTimeout = lockTimeout;
+    options.dedup = program.get<bool>("--dedup");
+    if (program.is_used("--manifest")) {
+        options.manifest = program.get<std::string>("--manifest");
     }
-    return true;
+    return backupDisks(diskfile, disks, options);
 }
 
 /// <summary>
-/// return true if a file exists on a disk
+/// backup disks
 /// </summary>
-/// <param name="disk">disk to search</param>
-/// <param name="filename">file to search for</param>
-/// <returns>true on success</returns>
-bool fileExists(d64& disk, const std::string& filename)
+/// <param name="diskfile">diskfile to use</param>
+/// <param name="order">disks to backup files. If there are files not on the list they are put at the end</param>
+void handleBackup(const std::string& diskfile, const std::vector<std::string>& disks)
 {
-    return disk.findFile(filename).has_value();
+    backupImages(diskfile, disks);
 }
 
 /// <summary>
-/// copy files from sourceDisk to targetDisk
-/// if files wont fit create another target disk
+/// Catalog the disk images below a directory
 /// </summary>
-/// <param name="sourceDisk">source disk to copy</param>
-/// <param name="targetDisk">gets the copied files</param>
-/// <returns>true on success</returns>
-bool copyFiles(d64& sourceDisk, d64& targetDisk)
+/// <param name="diskfile">unused</param>
+/// <param name="dir">directory to scan</param>
+void handleScan([[maybe_unused]] const std::string& diskfile, const std::string& dir)
 {
-    for (const auto& fileEntry : sourceDisk.directory()) {
-        std::string filename = d64::Trim(fileEntry.file_name);
-
-        if (fileExists(targetDisk, filename)) {
-            auto valid = false;
-            do {
-                if (conformation != skip_all && conformation != overwrite_all) {
-                    std::cout << "File \"" << filename << "\" already exists. Overwrite?  (y/n or a=all/x=none):";
-                    char response;
-                    std::cin >> response;
-                    response = toupper(response);
-                    switch (response) {
-                        case 'Y':
-                            conformation = overwrite_file;
-                            valid = true;
-                            break;
-                        case 'N':
-                            conformation = skip_file;
-                            valid = true;
-                            break;
-                        case 'A':
-                            conformation = overwrite_all;
-                            valid = true;
-                            break;
-                        case 'X':
-                            conformation = skip_all;
-                            valid = true;
-                            break;
-                        default:
-                            break;
-                    }
-                }
-                else {
-                    valid = true;
-                }
-            } while (!valid);
+    // images are read from their files
+    flushSessions();
 
-            if (conformation == skip_all || conformation == skip_file) {
-                std::cout << "Skipping \"" << filename << "\"\n";
-                continue;
-            }
-            std::cout << "overwriting \"" << filename << "\"\n";
-            targetDisk.removeFile(filename);
+    auto indexfile = (std::filesystem::path(dir) / "d64.idx").string();
+    if (program.is_used("--index")) {
+        indexfile = program.get<std::string>("--index");
+    }
+
+    ScanResult result;
+    if (scanArchive(dir, indexfile, result, lockTimeout)) {
+        std::cout << "Scanned " << result.images << " images (" << result.scanned << " new or changed, "
+            << result.unchanged << " unchanged, " << result.invalid << " invalid), "
+            << result.files << " files. Index: " << indexfile << "\n";
+        if (result.locked > 0) {
+            std::cout << result.locked << " images locked by another process, scanned next time\n";
         }
+    }
+}
 
-        // allow dest to have 2 free sectors
-        if ((targetDisk.getFreeSectorCount() + 2) * 256 <= fileEntry.file_size[0] + fileEntry.file_size[1] * 256) {
-            // This wont fit.
-            backup_disk_num++;
+/// <summary>
+/// Compare two disk images
+/// </summary>
+/// <param name="diskfile">first image</param>
+/// <param name="otherfile">second image</param>
+/// <returns>true if the images are identical</returns>
+bool compareDisks(const std::string& diskfile, const std::string& otherfile)
+{
+    D64View a, b;
+    if (!openView(a, diskfile)) {
+        std::cerr << "Error: Failed to load disk " << diskfile << "\n";
+        return false;
+    }
+    if (!openView(b, otherfile)) {
+        std::cerr << "Error: Failed to load disk " << otherfile << "\n";
+        return false;
+    }
 
-            std::string target_name = target_backup_base_name + backup_disk_num + ".d64";
-            targetDisk.formatDisk("BACKUP" + backup_disk_num);
-            targetDisk.save(target_name);
-        }
+    OutputBuffer out(outputFormat);
+    auto diff = diffImages(a, b);
+    printDiff(diskfile, otherfile, diff, out);
+    out.flush();
+    return diff.identical;
+}
 
-        auto fileData = sourceDisk.readFile(filename);
-        if (fileData.has_value()) {
-            targetDisk.addFile(filename, static_cast<FileTypes>(fileEntry.file_type), fileData.value());
-        }
-        else {
-            std::cerr << "Error: Failed to copy \"" << filename << "\"\n";
+/// <summary>
+/// Compare two disk images
+/// </summary>
+/// <param name="diskfile">first image</param>
+/// <param name="otherfile">second image</param>
+void handleDiff(const std::string& diskfile, const std::string& otherfile)
+{
+    compareDisks(diskfile, otherfile);
+}
+
+/// <summary>
+/// Write a patch with the sectors that differ between two images
+/// </summary>
+/// <param name="diskfile">image the patch applies to</param>
+/// <param name="newfile">image the patch produces</param>
+/// <param name="patchfile">patch file to write</param>
+void handleMakePatch(const std::string& diskfile, const std::string& newfile, const std::string& patchfile)
+{
+    D64View base, result;
+    if (!openView(base, diskfile)) {
+        std::cerr << "Error: Failed to load disk " << diskfile << "\n";
+        return;
+    }
+    if (!openView(result, newfile)) {
+        std::cerr << "Error: Failed to load disk " << newfile << "\n";
+        return;
+    }
+
+    PatchInfo info;
+    if (makePatch(base, result, patchfile, info)) {
+        std::cout << "Created patch: " << patchfile << ", " << info.changed << " of " << info.sectors << " sectors in "
+            << info.runs << " runs, " << info.bytes << " bytes\n";
+    }
+}
+
+/// <summary>
+/// Apply a patch to an image file
+/// </summary>
+/// <param name="diskfile">image to patch</param>
+/// <param name="patchfile">patch file</param>
+/// <returns>true if the image is patched</returns>
+bool patchDisk(const std::string& diskfile, const std::string& patchfile)
+{
+    diskname = diskfile;
+
+    // the patch is checked against the file, a resident image is written first
+    if (auto image = sessions.find(diskfile)) {
+        if (!image->flush()) {
             return false;
         }
+    }
 
+    PatchInfo info;
+    if (!applyPatch(diskfile, patchfile, info)) {
+        return false;
+    }
+    sessions.close(diskfile);
+    if (info.alreadyApplied) {
+        std::cout << "Patch already applied: " << diskfile << "\n";
+    }
+    else {
+        std::cout << "Patched disk: " << diskfile << ", " << info.changed << " sectors written\n";
     }
     return true;
 }
 
 /// <summary>
-/// Backup up source to target
+/// Apply a patch to an image file
+/// </summary>
+/// <param name="diskfile">image to patch</param>
+/// <param name="patchfile">patch file</param>
+void handlePatch(const std::string& diskfile, const std::string& patchfile)
+{
+    patchDisk(diskfile, patchfile);
+}
+
+/// <summary>
+/// Copy an image between the raw .d64 and the compressed .d64z format
 /// </summary>
-/// <param name="source">source disk name</param>
-/// <param name="target">target disk name</param>
-void Backup(const std::string& source, const std::string& target)
+/// <param name="diskfile">image to read</param>
+/// <param name="target">image to write, the extension picks the format</param>
+void handleConvert(const std::string& diskfile, const std::string& target)
 {
-    d64 sourceDisk, targetDisk;
+    if (auto image = sessions.find(diskfile)) {
+        if (!image->flush()) {
+            return;
+        }
+    }
 
-    if (!loadDisks(sourceDisk, targetDisk, source, target)) {
+    D64View check;
+    std::vector<uint8_t> raw;
+    if (!check.open(diskfile) || !readImageFile(diskfile, raw)) {
+        std::cerr << "Error: Could not load disk " << diskfile << ".\n";
+        return;
+    }
+    check.close();
+    if (!writeImageFile(target, raw)) {
+        std::cerr << "Error: Could not write " << target << ".\n";
         return;
     }
+    sessions.close(target);
+
+    std::error_code ec;
+    auto before = std::filesystem::file_size(diskfile, ec);
+    auto after = std::filesystem::file_size(target, ec);
+    std::cout << "Converted " << diskfile << " (" << before << " bytes) to " << target << " (" << after << " bytes, "
+        << (before > 0 ? after * 100 / before : 0) << "%)\n";
+}
+
+/// <summary>
+/// Lay out the files of an image for fast loading
+/// </summary>
+/// <param name="diskfile">image to optimize</param>
+/// <param name="args">optional interleave</param>
+void handleOptimize(const std::string& diskfile, const std::vector<std::string>& args)
+{
+    diskname = diskfile;
 
-    if (!copyFiles(sourceDisk, targetDisk)) {
-        std::cerr << "Error: Backup failed.\n";
+    OptimizeOptions options;
+    if (!args.empty()) {
+        options.interleave = std::atoi(args[0].c_str());
+    }
+    else if (program.is_used("--interleave")) {
+        options.interleave = std::atoi(program.get<std::string>("--interleave").c_str());
+    }
+    if (options.interleave < 1 || options.interleave > 20) {
+        std::cerr << "Invalid value for --interleave. Expecting 1 - 20.\n";
+        return;
+    }
+
+    // the layout is written to the file, a resident image is written first
+    if (auto image = sessions.find(diskfile)) {
+        if (!image->flush()) {
+            return;
+        }
+    }
+
+    std::vector<uint8_t> raw;
+    OptimizeResult result;
+    if (!readImageFile(diskfile, raw)) {
+        std::cerr << "Error: Could not load disk.\n";
+        diskname.clear();
+        return;
+    }
+    if (!optimizeLayout(raw, options, result)) {
         return;
     }
 
-    targetDisk.save(target);
+    auto dryRun = program.get<bool>("--dry-run");
+    if (!dryRun) {
+        if (!writeImageFile(diskfile, raw)) {
+            std::cerr << "Error: Could not save disk " << diskfile << ".\n";
+            return;
+        }
+        sessions.close(diskfile);
+    }
+    std::cout << (dryRun ? "Would optimize " : "Optimized ") << diskfile << ": " << result.moved << " files, " << result.blocks
+        << " blocks with interleave " << options.interleave << ", head steps " << result.stepsBefore << " -> "
+        << result.stepsAfter;
+    if (result.fixed > 0) {
+        std::cout << ", " << result.fixed << " files left in place";
+    }
+    std::cout << "\n";
 }
 
 /// <summary>
-/// backup disks
+/// Generate test images
 /// </summary>
-/// <param name="diskfile">diskfile to use</param>
-/// <param name="order">disks to backup files. If there are files not on the list they are put at the end</param>
-void handleBackup(const std::string& diskfile, const std::vector<std::string>& disks)
+/// <param name="diskfile">unused</param>
+/// <param name="dir">directory to write the images to</param>
+void handleGenerate([[maybe_unused]] const std::string& diskfile, const std::string& dir)
 {
-    d64 target;
-    d64 source;
-    target_backup_base_name = diskfile;
-    if (diskfile.ends_with(".d64") || diskfile.ends_with(".D64")) {
-        target_backup_base_name = diskfile.substr(0, diskfile.length() - 4);
-    }
-    std::string target_name = target_backup_base_name + ".d64";
-    if (!target.load(target_name)) {
-        target.formatDisk("NEW DISK");
-    }
-    target.rename_disk("BACKUP");
-    target.save(target_name);
-    backup_disk_num = '0';
-    conformation = skip_file;
-    auto n = 0;
-    for (auto& src : disks) {
-        std::cout << "disk " << ++n << " of " << disks.size() << " " << src << '\n';
-        Backup(src, target_name);
+    GeneratorOptions options;
+    if (program.is_used("--count")) {
+        options.count = std::atoi(program.get<std::string>("--count").c_str());
+    }
+    if (program.is_used("--seed")) {
+        options.seed = std::strtoull(program.get<std::string>("--seed").c_str(), nullptr, 0);
+    }
+    if (program.is_used("--corrupt")) {
+        options.corruptPercent = std::clamp(std::atoi(program.get<std::string>("--corrupt").c_str()), 0, 100);
+    }
+    options.lockTimeout = lockTimeout;
+
+    OutputBuffer out(outputFormat);
+    auto images = generateImages(dir, options);
+    printGenerated(images, out);
+    out.flush();
+
+    auto failed = std::count_if(images.begin(), images.end(), [](const GeneratedImage& image) { return !image.ok; });
+    if (failed > 0) {
+        std::cerr << "Error: " << failed << " of " << images.size() << " images could not be written.\n";
     }
-    std::cout << "Backup complete: " << target_backup_base_name << ".d64" << "\n";
+}
+
+/// <summary>
+/// Show the image cache counters, or set its memory limit
+/// </summary>
+/// <param name="diskfile">unused</param>
+/// <param name="args">optional memory limit in MB</param>
+void handleCache([[maybe_unused]] const std::string& diskfile, const std::vector<std::string>& args)
+{
+    if (!args.empty()) {
+        sessions.setMemoryLimit(static_cast<size_t>(std::max(0, std::atoi(args[0].c_str()))) << 20);
+    }
+
+    auto stats = sessions.stats();
+    OutputBuffer out(outputFormat);
+    if (out.json()) {
+        out << "{\"images\":" << stats.images << ",\"bytes\":" << stats.bytes << ",\"limit\":" << stats.limit
+            << ",\"hits\":" << stats.hits << ",\"misses\":" << stats.misses << ",\"stale\":" << stats.stale
+            << ",\"evictions\":" << stats.evictions << "}\n";
+    }
+    else if (out.csv()) {
+        out << "images,bytes,limit,hits,misses,stale,evictions\n"
+            << stats.images << ',' << stats.bytes << ',' << stats.limit << ',' << stats.hits << ','
+            << stats.misses << ',' << stats.stale << ',' << stats.evictions << '\n';
+    }
+    else {
+        out << "Cache: " << stats.images << " images, " << stats.bytes / 1024 << " of " << stats.limit / 1024 << " KB, "
+            << stats.hits << " hits, " << stats.misses << " misses, " << stats.stale << " reloaded after a change, "
+            << stats.evictions << " evicted\n";
+    }
+    out.flush();
+}
+
+/// <summary>
+/// Images a command uses and whether it changes them
+/// </summary>
+/// <param name="command">command</param>
+/// <param name="args">arguments without flags, the current disk is used if none is an image</param>
+/// <param name="fix">verify repairs the images</param>
+/// <param name="images">gets the sorted, normalized image paths</param>
+/// <param name="write">gets true if the command modifies the images</param>
+/// <returns>false for commands that work on many images</returns>
+bool commandImages(const std::string& command, const std::vector<std::string>& args, bool fix, std::vector<std::string>& images, bool& write)
+{
+    static const std::unordered_set<std::string> readers = {
+        "list", "dir", "bam", "dump", "extract", "diff", "mkpatch", "load", "cache", "help", "--help", "--h"
+    };
+    static const std::unordered_set<std::string> global = { "backup", "scan", "generate", "autosave" };
+
+    images.clear();
+    if ((args.empty() || !isImageName(args[0])) && !diskname.empty()) {
+        images.push_back(SessionPool::key(diskname));
+    }
+    auto pattern = false;
+    for (const auto& arg : args) {
+        // no current disk
+        if (arg.empty()) {
+            continue;
+        }
+        if (isImageName(arg)) {
+            images.push_back(SessionPool::key(arg));
+        }
+        pattern = pattern || !isImageName(arg) || arg.find_first_of("*?") != std::string::npos;
+    }
+    std::sort(images.begin(), images.end());
+    images.erase(std::unique(images.begin(), images.end()), images.end());
+    write = !readers.contains(command) && !(command == "verify" && !fix);
+
+    // verify of a list, a directory or a pattern checks many images
+    return !(global.contains(command) || (command == "verify" && (images.size() > 1 || pattern)));
+}
+
+/// <summary>
+/// Lock the images of a command against other processes.
+/// Commands on many images take no locks.
+/// </summary>
+/// <param name="command">command</param>
+/// <param name="args">arguments without flags</param>
+/// <param name="fix">verify repairs the images</param>
+/// <param name="locks">gets the locks, held until the command is done</param>
+/// <returns>false if an image stayed locked by another process</returns>
+bool lockCommandImages(const std::string& command, const std::vector<std::string>& args, bool fix, std::vector<FileLock>& locks)
+{
+    std::vector<std::string> images;
+    auto write = false;
+    if (!commandImages(command, args, fix, images, write)) {
+        return true;
+    }
+
+    // images with unsaved changes are already locked by this process
+    std::lock_guard<std::mutex> guard(retainedLock);
+    std::erase_if(images, [](const std::string& image) { return retainedLocks.contains(image); });
+    return lockImages(images, write, lockTimeout, locks);
+}
+
+/// <summary>
+/// Keep the exclusive locks of images whose changes are deferred
+/// until the changes are written, and drop those of images saved since
+/// </summary>
+/// <param name="locks">locks of the command that ran</param>
+void retainLocks(std::vector<FileLock>& locks)
+{
+    std::lock_guard<std::mutex> guard(retainedLock);
+    for (auto& lock : locks) {
+        auto image = lock.isExclusive() ? sessions.find(lock.path()) : nullptr;
+        if (image && image->isDirty()) {
+            retainedLocks[lock.path()] = std::move(lock);
+        }
+    }
+    locks.clear();
+    std::erase_if(retainedLocks, [](const auto& item) {
+        auto image = sessions.find(item.first);
+        return !image || !image->isDirty();
+    });
 }
 
 /// <summary>
@@ -799,23 +1755,32 @@ void handleBackup(const std::string& diskfile, const std::vector<std::string>& d
 /// </summary>
 /// <param name="command">command to ececute</param>
 /// <param name="params">parameters for function</param>
-void executeCommand(const std::string& command, std::vector<std::string>& params)
+/// <returns>false if the command or its parameters were invalid</returns>
+bool executeCommand(const std::string& command, std::vector<std::string>& params)
 {
     auto flag = false;
     auto param_error = false;
 
     // if the user did not supply a diskname, use the last one
-    if (!(params.size() > 0 && params[0].ends_with(".d64"))) {
+    if (!(params.size() > 0 && isImageName(params[0]))) {
         params.insert(params.begin(), diskname);
     }
 
     auto it = functionTable.find(command);
     if (it == functionTable.end()) {
         std::cerr << "Error: Unknown command \"" << command << "\"\n";
-        return;
+        return false;
+    }
+
+    // other processes may use the same images
+    std::vector<std::string> targets = params;
+    auto fix = command == "verify" && verifyArguments(params, targets);
+    std::vector<FileLock> locks;
+    if (!lockCommandImages(command, targets, fix, locks)) {
+        return false;
     }
 
-    const auto& entry = functionTable[command];
+    const auto& entry = it->second;
     switch (entry.type) {
         case no_param:
             entry.f0();
@@ -860,11 +1825,49 @@ void executeCommand(const std::string& command, std::vector<std::string>& params
 
         default:
             std::cerr << "Error: Unknown command type\n";
+            return false;
     }
+    retainLocks(locks);
     if (param_error) {
         std::cerr << "Error: Missing parameters for command " << command << "\n";
     }
-    return;
+    return !param_error;
+}
+
+/// <summary>
+/// Split a command line into arguments.
+/// Double quotes group words containing spaces.
+/// </summary>
+/// <param name="line">command line</param>
+/// <returns>arguments</returns>
+std::vector<std::string> splitCommand(const std::string& line)
+{
+    std::vector<std::string> args;
+    std::string arg;
+    auto quoted = false;
+    auto inArg = false;
+
+    for (auto ch : line) {
+        if (ch == '"') {
+            quoted = !quoted;
+            inArg = true;
+            continue;
+        }
+        if (!quoted && isspace(static_cast<unsigned char>(ch))) {
+            if (inArg) {
+                args.push_back(arg);
+                arg.clear();
+                inArg = false;
+            }
+            continue;
+        }
+        arg += ch;
+        inArg = true;
+    }
+    if (inArg) {
+        args.push_back(arg);
+    }
+    return args;
 }
 
 // <summary>
@@ -875,14 +1878,17 @@ void interactiveShell()
     std::string input;
     std::cout << "d64 CLI Interactive Mode (type 'exit' to quit type load <diskname> to load a disk)\n";
 
+    // keep the image in memory until save/exit or autosave
+    sessions.setDeferred(true);
+    stdinCommands = true;
     while (true) {
-        std::cout << '[' << (diskname.size() > 0 ? diskname : "no disk") << "] d64> ";
-        std::getline(std::cin, input);
-        if (input == "exit") break;
-
-        std::istringstream iss(input);
-        std::vector<std::string> args{ std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>{} };
+        std::cout << '[' << (diskname.size() > 0 ? diskname : "no disk") << (sessions.isDirty() ? "*" : "") << "] d64> ";
+        if (!std::getline(std::cin, input) || input == "exit") {
+            sessions.flush();
+            break;
+        }
 
+        auto args = splitCommand(input);
         if (args.empty()) continue;
 
         std::string command = args[0];
@@ -891,12 +1897,111 @@ void interactiveShell()
             executeCommand(command, args);
         }
         catch (const std::exception& e) {
+            // changes of earlier commands are still pending, keep going
             std::cerr << "Error: " << e.what() << "\n";
-            return;
         }
     }
 }
 
+ImageLocks imageLocks;
+
+/// <summary>
+/// Run a command line for a server client.
+/// The images named by the command, or the connection's current disk,
+/// are locked shared for commands that only read them and exclusive
+/// for the others. Commands working on many images run alone.
+/// </summary>
+/// <param name="line">command line</param>
+/// <returns>false if the command failed</returns>
+bool serveCommand(const std::string& line)
+{
+    PhaseTimer timer(operation_phase);
+    auto args = splitCommand(line);
+    if (args.empty()) {
+        return true;
+    }
+    std::string command = args[0];
+    args.erase(args.begin());
+
+    std::vector<std::string> targets = args;
+    auto fix = command == "verify" && verifyArguments(args, targets);
+    std::vector<std::string> images;
+    auto write = false;
+    if (!commandImages(command, targets, fix, images, write)) {
+        std::unique_lock<std::shared_mutex> all(imageLocks.global());
+        return executeCommand(command, args);
+    }
+
+    std::shared_lock<std::shared_mutex> all(imageLocks.global());
+
+    // images are locked in sorted order so two commands cannot deadlock
+    std::vector<std::shared_ptr<std::shared_mutex>> mutexes;
+    std::vector<std::shared_lock<std::shared_mutex>> readLocks;
+    std::vector<std::unique_lock<std::shared_mutex>> writeLocks;
+    for (const auto& image : images) {
+        mutexes.push_back(imageLocks.get(image));
+        if (write) {
+            writeLocks.emplace_back(*mutexes.back());
+        }
+        else {
+            readLocks.emplace_back(*mutexes.back());
+        }
+    }
+    return executeCommand(command, args);
+}
+
+/// <summary>
+/// Run a script of interactive commands.
+/// Every image is loaded on first use, all commands are applied
+/// in memory and each modified image is written once at the end.
+/// </summary>
+/// <param name="scriptfile">script file, - for stdin</param>
+/// <returns>number of failed commands</returns>
+int runScript(const std::string& scriptfile)
+{
+    std::ifstream file;
+    if (scriptfile != "-") {
+        file.open(scriptfile);
+        if (!file.is_open()) {
+            std::cerr << "Error: unable to open script " << scriptfile << ".\n";
+            return 1;
+        }
+    }
+    std::istream& in = (scriptfile == "-") ? std::cin : file;
+    stdinCommands = scriptfile == "-";
+
+    sessions.setDeferred(true);
+
+    auto errors = 0;
+    auto lineno = 0;
+    std::string input;
+    while (std::getline(in, input)) {
+        ++lineno;
+        auto args = splitCommand(input);
+        if (args.empty() || args[0].starts_with('#')) continue;
+        if (args[0] == "exit") break;
+
+        std::string command = args[0];
+        std::transform(command.begin(), command.end(), command.begin(), ::tolower);
+        args.erase(args.begin());
+        try {
+            if (!executeCommand(command, args)) {
+                std::cerr << scriptfile << ":" << lineno << ": command failed\n";
+                ++errors;
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << scriptfile << ":" << lineno << ": Error: " << e.what() << "\n";
+            ++errors;
+        }
+    }
+
+    if (!sessions.flush()) {
+        ++errors;
+    }
+    return errors;
+}
+
 /// <summary>
 /// Main entry point
 /// </summary>
@@ -905,8 +2010,10 @@ void interactiveShell()
 /// <returns></returns>
 int main(int argc, char* argv[])
 {
+    auto started = std::chrono::steady_clock::now();
+
     program.add_argument("command")
-        .help("Command to execute (create, format, add, addrel, list, dir, extract, remove, rename, verify, compact, bam, dump, lock, unlock, reorder, rename-disk)")
+        .help("Command to execute (create, format, add, addrel, list, dir, extract, remove, rename, verify, compact, bam, dump, lock, unlock, reorder, rename-disk, scan, diff, generate, mkpatch, patch, convert, optimize)")
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("diskfile")
@@ -914,11 +2021,20 @@ int main(int argc, char* argv[])
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("filename")
-        .help("File to add, extract, remove, lock or unlock")
+        .help("File to add, extract, remove, lock or unlock (add - reads stdin)")
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("newname")
-        .help("New name for renaming a file or disk")
+        .help("New name for renaming a file or disk, or - to extract to stdout")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--all")
+        .help("Extract all files")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--outdir")
+        .help("Directory to extract files to")
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("--fix")
@@ -930,10 +2046,40 @@ int main(int argc, char* argv[])
         .help("List of filenames for reordering")
         .nargs(argparse::nargs_pattern::any);
 
+    program.add_argument("--files")
+        .help("More files, directories or wildcard patterns to add or verify")
+        .nargs(argparse::nargs_pattern::any);
+
     program.add_argument("--disks")
         .help("List of disks to backup")
         .nargs(argparse::nargs_pattern::any);
 
+    program.add_argument("--dry-run")
+        .help("Print the backup plan or the optimize result without writing any disks")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--dedup")
+        .help("Backup: skip files identical to a file already backed up")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--manifest")
+        .help("Backup: write a csv of the volume and source disk of every file")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--name")
+        .help("Add from stdin (-): file name on the disk")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--type")
+        .help("Add from stdin (-): file type prg, seq or usr (default prg)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--interleave")
+        .help("Optimize: sectors between consecutive blocks of a file (default 10, the 1541 DOS)")
+        .nargs(argparse::nargs_pattern::optional);
+
     program.add_argument("--tracks")
         .help("number of tracks to format (35 or 40)")
         .nargs(argparse::nargs_pattern::optional);
@@ -943,11 +2089,11 @@ int main(int argc, char* argv[])
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("--track")
-        .help("Track to dump")
+        .help("Track to dump: a track, first-last or all (default all)")
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("--sector")
-        .help("Sector to dump")
+        .help("Sector to dump (default every sector of the tracks)")
         .nargs(argparse::nargs_pattern::optional);
 
     program.add_argument("--interactive")
@@ -955,6 +2101,55 @@ int main(int argc, char* argv[])
         .default_value(false)
         .implicit_value(true);
 
+    program.add_argument("--orderfile")
+        .help("File with one filename per line for reordering")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--script")
+        .help("Run commands from a script file (- for stdin). Each disk is loaded and saved once")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--format")
+        .help("Output format of list, bam, dump, verify and diff: text, json or csv")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--index")
+        .help("Scan: index file to create or update (default <dir>/d64.idx)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--count")
+        .help("Generate: number of images (default 1)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--seed")
+        .help("Generate: seed, the same seed and count give the same images (default 1)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--corrupt")
+        .help("Generate: percentage of images that get BAM errors (default 0)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--serve")
+        .help("Serve commands on a unix domain socket, see server.h for the protocol")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--cache-size")
+        .help("Shell, script and server: memory for resident images in MB (default 64)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--lock-timeout")
+        .help("Seconds to wait for an image locked by another process, 0 fails at once, -1 waits forever (default 30)")
+        .nargs(argparse::nargs_pattern::optional);
+
+    program.add_argument("--stats")
+        .help("Print time per phase, sectors and bytes read and written, allocations and peak RSS to stderr (json with --format json)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--autosave")
+        .help("Interactive mode: save a modified disk every n seconds (default only on save/exit)")
+        .nargs(argparse::nargs_pattern::optional);
+
     try {
         if (argc == 1) {
             program.parse_args({argv[0], "--help"}); // Forces --help to be the default
@@ -962,15 +2157,59 @@ int main(int argc, char* argv[])
         else {
             program.parse_args(argc, argv);
         }
+        if (program.is_used("--format") && !parseOutputFormat(program.get<std::string>("--format"), outputFormat)) {
+            std::cerr << "Invalid value for --format. Expecting text, json or csv.\n";
+            return 1;
+        }
+        if (program.get<bool>("--stats")) {
+            enableStats(started);
+            std::atexit([] { printStats(std::cerr, outputFormat); });
+        }
+        if (program.is_used("--lock-timeout")) {
+            auto seconds = std::atoi(program.get<std::string>("--lock-timeout").c_str());
+            lockTimeout = seconds < 0 ? FileLock::WAIT_FOREVER : seconds * 1000;
+        }
+        if (program.is_used("--cache-size")) {
+            sessions.setMemoryLimit(static_cast<size_t>(std::max(0, std::atoi(program.get<std::string>("--cache-size").c_str()))) << 20);
+        }
+        if (program.is_used("--serve")) {
+            auto code = runServer(program.get<std::string>("--serve"), serveCommand);
+            sessions.flush();
+            return code;
+        }
+
+        // the server times each command, everything else is one operation
+        PhaseTimer operation(operation_phase);
         if (program.get<bool>("--interactive")) {
+            if (program.is_used("--autosave")) {
+                sessions.setAutosaveInterval(std::atoi(program.get<std::string>("--autosave").c_str()));
+            }
             interactiveShell();
             return 0;
         }
+        if (program.is_used("--script")) {
+            return runScript(program.get<std::string>("--script")) == 0 ? 0 : 1;
+        }
 
         std::string command = program.get<std::string>("command");
         std::transform(command.begin(), command.end(), command.begin(), ::tolower);
 
         auto diskfile = program.get<std::string>("diskfile");
+
+        // shared for commands that read the images, exclusive for the others
+        std::vector<std::string> named;
+        for (auto positional : { "diskfile", "filename", "newname" }) {
+            if (program.is_used(positional)) {
+                named.push_back(program.get<std::string>(positional));
+            }
+        }
+        auto more = program.get<std::vector<std::string>>("--files");
+        named.insert(named.end(), more.begin(), more.end());
+        std::vector<FileLock> locks;
+        if (!lockCommandImages(command, named, program.get<bool>("--fix"), locks)) {
+            return 1;
+        }
+
         if (command == "create" || command == "format") {
             auto use40tracks = false;
             try {
@@ -989,7 +2228,10 @@ int main(int argc, char* argv[])
             handleCreate(diskfile, use40tracks);
         }
         else if (command == "add") {
-            handleAdd(diskfile, program.get<std::string>("filename"));
+            std::vector<std::string> files{ program.get<std::string>("filename") };
+            auto more = program.get<std::vector<std::string>>("--files");
+            files.insert(files.end(), more.begin(), more.end());
+            handleAdd(diskfile, files);
         }
         else if (command == "addrel") {
             int recordsize = 0;
@@ -1008,7 +2250,18 @@ int main(int argc, char* argv[])
             handleList(diskfile);
         }
         else if (command == "extract") {
-            handleExtract(diskfile, program.get<std::string>("filename"));
+            auto all = program.get<bool>("--all");
+            auto pattern = all ? "*" : program.get<std::string>("filename");
+            if (all && (program.present<std::string>("filename") == "-" || program.present<std::string>("newname") == "-")) {
+                std::cerr << "Error: --all cannot extract to stdout.\n";
+                return 1;
+            }
+            if (program.present<std::string>("newname") == "-") {
+                extractToStdout(diskfile, pattern);
+            }
+            else {
+                handleExtract(diskfile, pattern);
+            }
         }
         else if (command == "lock") {
             handleLock(diskfile, program.get<std::string>("filename"));
@@ -1023,7 +2276,22 @@ int main(int argc, char* argv[])
             handleRename(diskfile, program.get<std::string>("filename"), program.get<std::string>("newname"));
         }
         else if (command == "verify") {
-            handleVerify(diskfile, program.get<bool>("--fix"));
+            std::vector<std::string> disks{ diskfile };
+            for (auto positional : { "filename", "newname" }) {
+                if (program.is_used(positional)) {
+                    disks.push_back(program.get<std::string>(positional));
+                }
+            }
+            auto more = program.get<std::vector<std::string>>("--files");
+            disks.insert(disks.end(), more.begin(), more.end());
+
+            std::error_code ec;
+            if (disks.size() == 1 && diskfile.find_first_of("*?") == std::string::npos && !std::filesystem::is_directory(diskfile, ec)) {
+                handleVerify(diskfile, program.get<bool>("--fix"));
+            }
+            else {
+                return verifyDisks(disks, program.get<bool>("--fix")) ? 0 : 1;
+            }
         }
         else if (command == "compact") {
             handleCompact(diskfile);
@@ -1032,15 +2300,38 @@ int main(int argc, char* argv[])
             handleReorder(diskfile, program.get<std::vector<std::string>>("--order"));
         }
         else if (command == "backup") {
-            handleBackup(diskfile, program.get<std::vector<std::string>>("--disks"));
+            return backupImages(diskfile, program.get<std::vector<std::string>>("--disks")) ? 0 : 1;
+        }
+        else if (command == "diff") {
+            return compareDisks(diskfile, program.get<std::string>("filename")) ? 0 : 1;
+        }
+        else if (command == "generate") {
+            handleGenerate("", diskfile);
+        }
+        else if (command == "mkpatch") {
+            handleMakePatch(diskfile, program.get<std::string>("filename"), program.get<std::string>("newname"));
+        }
+        else if (command == "optimize") {
+            handleOptimize(diskfile, {});
+        }
+        else if (command == "convert") {
+            handleConvert(diskfile, program.get<std::string>("filename"));
+        }
+        else if (command == "patch") {
+            return patchDisk(diskfile, program.get<std::string>("filename")) ? 0 : 1;
+        }
+        else if (command == "scan") {
+            handleScan("", diskfile);
         }
         else if (command == "rename-disk") {
             handleDiskRename(diskfile, program.get<std::string>("filename"));
         }
         else if (command == "dump") {
-            auto t = std::atoi(program.get<std::string>("--track").c_str());
-            auto s = std::atoi(program.get<std::string>("--sector").c_str());
-            handleDumpSector(diskfile, t, s);
+            std::vector<std::string> range{ program.is_used("--track") ? program.get<std::string>("--track") : "all" };
+            if (program.is_used("--sector")) {
+                range.push_back(program.get<std::string>("--sector"));
+            }
+            handleDump(diskfile, range);
         }
         else {
             std::cerr << "Unknown command.\n";
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "d64view.h"
+#include "optimize.h"
+
+namespace {
+
+/// <summary>
+/// A file whose blocks are moved
+/// </summary>
+struct Movable {
+    DirEntryView entry;
+    std::vector<std::pair<int, int>> from;
+    std::vector<std::pair<int, int>> to;
+};
+
+/// <summary>
+/// Head steps to load a chain when the head starts on the directory track
+/// </summary>
+int headSteps(const std::vector<std::pair<int, int>>& chain)
+{
+    auto steps = 0;
+    auto track = DIR_TRACK;
+    for (const auto& [t, s] : chain) {
+        steps += std::abs(t - track);
+        track = t;
+    }
+    return steps;
+}
+
+}
+
+/// <summary>
+/// Lay out the files of an image again.
+/// Files are placed one after another starting next to the
+/// directory track, first towards track 1, then outwards from
+/// track 19, so loading a file steps the head one track at a time.
+/// Within a track each block follows the previous one after the
+/// interleave, as the DOS does when it writes a file.
+/// REL files, open files, broken or cross linked chains and
+/// sectors that are marked used without belonging to a file stay
+/// where they are. The BAM is kept as it is except for the sectors
+/// that were moved, and the error byte of a moved sector moves with
+/// it. Every moved file is read back and compared with the original
+/// before the image is changed.
+/// </summary>
+/// <param name="raw">image bytes, replaced by the optimized image</param>
+/// <param name="options">interleave</param>
+/// <param name="result">gets the number of moved files and head steps</param>
+/// <returns>false if the image could not be read or optimized</returns>
+bool optimizeLayout(std::vector<uint8_t>& raw, const OptimizeOptions& options, OptimizeResult& result)
+{
+    result = {};
+    D64View disk;
+    disk.assign(raw);
+    if (!disk.isOpen() || disk.bam().empty()) {
+        std::cerr << "Error: Not a valid image.\n";
+        return false;
+    }
+    auto tracks = disk.tracks();
+
+    // sectors of every chain, a sector in two chains is cross linked
+    std::vector<int> claims(sectorCount(tracks));
+    auto entries = disk.directory();
+    std::vector<std::vector<std::pair<int, int>>> chains;
+    for (const auto& entry : entries) {
+        auto chain = disk.chain(entry.startTrack(), entry.startSector());
+        if (entry.sideTrack() != 0) {
+            auto side = disk.chain(entry.sideTrack(), entry.sideSector());
+            chain.insert(chain.end(), side.begin(), side.end());
+        }
+        for (const auto& [track, sector] : chain) {
+            ++claims[sectorIndex(track, sector)];
+        }
+        chains.push_back(std::move(chain));
+    }
+
+    std::vector<Movable> files;
+    std::vector<bool> fixed(claims.size()), moving(claims.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto& entry = entries[i];
+        const auto& chain = chains[i];
+        auto movable = entry.closed() && entry.type() != FileTypes::REL && entry.sideTrack() == 0 && !chain.empty()
+            && disk.readFile(entry).has_value();
+        for (const auto& [track, sector] : chain) {
+            movable = movable && track != DIR_TRACK && claims[sectorIndex(track, sector)] == 1;
+        }
+
+        for (const auto& [track, sector] : chain) {
+            (movable ? moving : fixed)[sectorIndex(track, sector)] = true;
+        }
+        if (movable) {
+            files.push_back({ entry, chain, {} });
+            result.blocks += static_cast<int>(chain.size());
+        }
+        else if (!chain.empty()) {
+            ++result.fixed;
+        }
+    }
+
+    // free sectors and the sectors of the moved files can be used
+    std::vector<bool> free(claims.size());
+    for (auto track = 1; track <= tracks; ++track) {
+        for (auto sector = 0; sector < sectorsPerTrack(track); ++sector) {
+            auto index = sectorIndex(track, sector);
+            free[index] = track != DIR_TRACK && !fixed[index] && (moving[index] || disk.isFree(track, sector));
+        }
+    }
+
+    std::vector<int> order;
+    for (auto track = DIR_TRACK - 1; track >= 1; --track) {
+        order.push_back(track);
+    }
+    for (auto track = DIR_TRACK + 1; track <= tracks; ++track) {
+        order.push_back(track);
+    }
+
+    size_t position = 0;
+    auto last = -options.interleave;
+    for (auto& file : files) {
+        for (size_t block = 0; block < file.from.size(); ++block) {
+            auto placed = false;
+            while (!placed && position < order.size()) {
+                auto track = order[position];
+                auto count = sectorsPerTrack(track);
+                auto start = ((last + options.interleave) % count + count) % count;
+                for (auto k = 0; k < count && !placed; ++k) {
+                    auto sector = (start + k) % count;
+                    auto index = sectorIndex(track, sector);
+                    if (free[index]) {
+                        free[index] = false;
+                        file.to.emplace_back(track, sector);
+                        last = sector;
+                        placed = true;
+                    }
+                }
+                if (!placed) {
+                    ++position;
+                }
+            }
+            if (!placed) {
+                std::cerr << "Error: No room to lay out " << file.entry.name() << ".\n";
+                return false;
+            }
+        }
+    }
+
+    // copy the blocks and link them in their new order
+    std::vector<uint8_t> updated = raw;
+    auto at = [&](int track, int sector) { return &updated[static_cast<size_t>(sectorIndex(track, sector)) * SECTOR_SIZE]; };
+    for (const auto& file : files) {
+        for (size_t block = 0; block < file.to.size(); ++block) {
+            auto [track, sector] = file.to[block];
+            auto data = disk.sector(file.from[block].first, file.from[block].second);
+            auto dest = at(track, sector);
+            std::memcpy(dest, data.data(), SECTOR_SIZE);
+            if (block + 1 < file.to.size()) {
+                dest[0] = static_cast<uint8_t>(file.to[block + 1].first);
+                dest[1] = static_cast<uint8_t>(file.to[block + 1].second);
+            }
+        }
+        auto entry = at(file.entry.track, file.entry.sector) + file.entry.slot * DIR_ENTRY_SIZE;
+        entry[3] = static_cast<uint8_t>(file.to[0].first);
+        entry[4] = static_cast<uint8_t>(file.to[0].second);
+
+        result.stepsBefore += headSteps(file.from);
+        result.stepsAfter += headSteps(file.to);
+    }
+    result.moved = static_cast<int>(files.size());
+
+    // release the old blocks, then allocate the new ones; other sectors
+    // keep their BAM bits and free counts, errors included
+    auto bam = at(DIR_TRACK, 0);
+    auto mark = [&](int track, int sector, bool markFree) {
+        auto entry = bam + bamOffset(track);
+        auto bit = static_cast<uint8_t>(1 << (sector % 8));
+        auto& bits = entry[1 + sector / 8];
+        if (((bits & bit) != 0) != markFree) {
+            bits ^= bit;
+            entry[0] = static_cast<uint8_t>(entry[0] + (markFree ? 1 : -1));
+        }
+    };
+    for (const auto& file : files) {
+        for (const auto& [track, sector] : file.from) {
+            mark(track, sector, true);
+        }
+    }
+    for (const auto& file : files) {
+        for (const auto& [track, sector] : file.to) {
+            mark(track, sector, false);
+        }
+    }
+
+    // the error byte describes the block, an emptied sector reads fine
+    if (disk.hasErrorTable()) {
+        auto errors = static_cast<size_t>(sectorCount(tracks)) * SECTOR_SIZE;
+        for (const auto& file : files) {
+            for (const auto& [track, sector] : file.from) {
+                updated[errors + sectorIndex(track, sector)] = 1;
+            }
+        }
+        for (const auto& file : files) {
+            for (size_t block = 0; block < file.to.size(); ++block) {
+                auto [track, sector] = file.to[block];
+                updated[errors + sectorIndex(track, sector)] = raw[errors + sectorIndex(file.from[block].first, file.from[block].second)];
+            }
+        }
+    }
+
+    // the same directory slots must give the same contents
+    D64View check;
+    check.assign(updated);
+    auto moved = check.directory();
+    for (const auto& file : files) {
+        auto original = disk.readFile(file.entry);
+        auto it = std::find_if(moved.begin(), moved.end(), [&](const DirEntryView& e) {
+            return e.track == file.entry.track && e.sector == file.entry.sector && e.slot == file.entry.slot;
+        });
+        if (it == moved.end() || check.readFile(*it) != original) {
+            std::cerr << "Error: " << file.entry.name() << " does not read back after the layout, the image was not changed.\n";
+            return false;
+        }
+    }
+
+    raw = std::move(updated);
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+/// <summary>
+/// Layout of the optimized files
+/// </summary>
+struct OptimizeOptions {
+    int interleave = 10;        // sectors between consecutive blocks, 10 for the 1541 DOS
+};
+
+/// <summary>
+/// What optimizeLayout did
+/// </summary>
+struct OptimizeResult {
+    int moved = 0;              // files laid out again
+    int fixed = 0;              // files left where they are
+    int blocks = 0;             // blocks of the moved files
+    int stepsBefore = 0;        // head steps to load every moved file
+    int stepsAfter = 0;
+};
+
+bool optimizeLayout(std::vector<uint8_t>& raw, const OptimizeOptions& options, OptimizeResult& result);
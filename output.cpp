@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <charconv>
+
+#include "output.h"
+
+namespace {
+
+// two hex digits and the printable character for every byte value
+struct HexTable {
+    char digits[256][2];
+    char printable[256];
+
+    HexTable()
+    {
+        const char* hex = "0123456789abcdef";
+        for (auto i = 0; i < 256; ++i) {
+            digits[i][0] = hex[i >> 4];
+            digits[i][1] = hex[i & 15];
+            printable[i] = (i >= 0x20 && i < 0x7f) ? static_cast<char>(i) : '.';
+        }
+    }
+};
+
+const HexTable hexTable;
+
+}
+
+/// <summary>
+/// Look up an output format by name
+/// </summary>
+/// <param name="name">text, json or csv</param>
+/// <param name="format">gets the format</param>
+/// <returns>false for an unknown name</returns>
+bool parseOutputFormat(const std::string& name, OutputFormat& format)
+{
+    if (name == "text") format = text_format;
+    else if (name == "json") format = json_format;
+    else if (name == "csv") format = csv_format;
+    else return false;
+    return true;
+}
+
+OutputBuffer& OutputBuffer::operator<<(int value)
+{
+    char digits[16];
+    auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    buffer.append(digits, end);
+    return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(size_t value)
+{
+    char digits[24];
+    auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    buffer.append(digits, end);
+    return *this;
+}
+
+/// <summary>
+/// Append text right aligned in a field
+/// </summary>
+/// <param name="text">text</param>
+/// <param name="width">field width</param>
+OutputBuffer& OutputBuffer::pad(const std::string& text, size_t width)
+{
+    if (text.size() < width) {
+        buffer.append(width - text.size(), ' ');
+    }
+    buffer += text;
+    return *this;
+}
+
+/// <summary>
+/// Append a number right aligned in a field
+/// </summary>
+/// <param name="value">number</param>
+/// <param name="width">field width</param>
+OutputBuffer& OutputBuffer::pad(int value, size_t width)
+{
+    char digits[16];
+    auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    return pad(std::string(digits, end), width);
+}
+
+/// <summary>
+/// Append a byte as two hex digits
+/// </summary>
+OutputBuffer& OutputBuffer::hex(uint8_t byte)
+{
+    buffer.append(hexTable.digits[byte], 2);
+    return *this;
+}
+
+/// <summary>
+/// Append bytes as hex digits without separators
+/// </summary>
+OutputBuffer& OutputBuffer::hex(const uint8_t* data, size_t size)
+{
+    auto start = buffer.size();
+    buffer.resize(start + size * 2);
+    auto dest = &buffer[start];
+    for (size_t i = 0; i < size; ++i) {
+        *dest++ = hexTable.digits[data[i]][0];
+        *dest++ = hexTable.digits[data[i]][1];
+    }
+    return *this;
+}
+
+/// <summary>
+/// Append rows of 16 bytes as hex digits followed by their
+/// printable characters. The rows are formatted in place in
+/// a single resize of the buffer.
+/// </summary>
+OutputBuffer& OutputBuffer::hexDump(const uint8_t* data, size_t size)
+{
+    const size_t ROW = 16;
+    const size_t GAP = 10;
+    auto rows = (size + ROW - 1) / ROW;
+    auto start = buffer.size();
+    buffer.resize(start + size * 4 + rows * (GAP + 1));
+    auto dest = &buffer[start];
+    for (size_t row = 0; row < size; row += ROW) {
+        auto count = std::min(ROW, size - row);
+        for (size_t i = 0; i < count; ++i) {
+            *dest++ = hexTable.digits[data[row + i]][0];
+            *dest++ = hexTable.digits[data[row + i]][1];
+            *dest++ = ' ';
+        }
+        for (size_t i = 0; i < GAP; ++i) {
+            *dest++ = ' ';
+        }
+        for (size_t i = 0; i < count; ++i) {
+            *dest++ = hexTable.printable[data[row + i]];
+        }
+        *dest++ = '\n';
+    }
+    return *this;
+}
+
+/// <summary>
+/// Append a quoted and escaped json string
+/// </summary>
+OutputBuffer& OutputBuffer::jsonString(const std::string& text)
+{
+    buffer += '"';
+    for (auto c : text) {
+        auto byte = static_cast<uint8_t>(c);
+        if (c == '"' || c == '\\') {
+            buffer += '\\';
+            buffer += c;
+        }
+        else if (byte < 0x20 || byte >= 0x7f) {
+            // PETSCII is not utf-8, keep every byte as a code point
+            buffer += "\\u00";
+            hex(byte);
+        }
+        else {
+            buffer += c;
+        }
+    }
+    buffer += '"';
+    return *this;
+}
+
+/// <summary>
+/// Append a csv field, quoted if needed
+/// </summary>
+OutputBuffer& OutputBuffer::csvField(const std::string& text)
+{
+    if (text.find_first_of(",\"\r\n") == std::string::npos) {
+        buffer += text;
+        return *this;
+    }
+    buffer += '"';
+    for (auto c : text) {
+        if (c == '"') buffer += '"';
+        buffer += c;
+    }
+    buffer += '"';
+    return *this;
+}
+
+/// <summary>
+/// Write the buffer to a stream and empty it
+/// </summary>
+/// <param name="os">stream to write to</param>
+void OutputBuffer::flush(std::ostream& os)
+{
+    os.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    os.flush();
+    buffer.clear();
+}
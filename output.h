@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <iostream>
+
+enum OutputFormat {
+    text_format,
+    json_format,
+    csv_format
+};
+
+bool parseOutputFormat(const std::string& name, OutputFormat& format);
+
+/// <summary>
+/// Output of one command.
+/// Text is formatted into a single buffer that is written
+/// to the stream in one call when the command is done.
+/// </summary>
+class OutputBuffer {
+public:
+    explicit OutputBuffer(OutputFormat format = text_format) : outputFormat(format) {}
+
+    OutputFormat format() const { return outputFormat; }
+    bool json() const { return outputFormat == json_format; }
+    bool csv() const { return outputFormat == csv_format; }
+
+    OutputBuffer& operator<<(const std::string& text) { buffer += text; return *this; }
+    OutputBuffer& operator<<(const char* text) { buffer += text; return *this; }
+    OutputBuffer& operator<<(char ch) { buffer += ch; return *this; }
+    OutputBuffer& operator<<(int value);
+    OutputBuffer& operator<<(size_t value);
+
+    OutputBuffer& pad(const std::string& text, size_t width);
+    OutputBuffer& pad(int value, size_t width);
+    OutputBuffer& hex(uint8_t byte);
+    OutputBuffer& hex(const uint8_t* data, size_t size);
+    OutputBuffer& hexDump(const uint8_t* data, size_t size);
+    OutputBuffer& jsonString(const std::string& text);
+    OutputBuffer& csvField(const std::string& text);
+    OutputBuffer& boolean(bool value) { buffer += value ? "true" : "false"; return *this; }
+
+    void reserve(size_t size) { buffer.reserve(size); }
+    const std::string& str() const { return buffer; }
+    void flush(std::ostream& os = std::cout);
+
+private:
+    std::string buffer;
+    OutputFormat outputFormat;
+};
@@ -0,0 +1,245 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "d64z.h"
+#include "hash.h"
+#include "patch.h"
+
+namespace {
+
+const char PATCH_MAGIC[4] = { 'D', '6', '4', 'P' };
+const uint32_t PATCH_VERSION = 1;
+
+const size_t HEADER_SIZE = 32;
+const size_t RUN_HEADER_SIZE = 4;
+const size_t TRAILER_SIZE = 8;
+
+void put16(std::string& out, uint16_t value)
+{
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>(value >> 8);
+}
+
+void put32(std::string& out, uint32_t value)
+{
+    put16(out, static_cast<uint16_t>(value & 0xffff));
+    put16(out, static_cast<uint16_t>(value >> 16));
+}
+
+void put64(std::string& out, uint64_t value)
+{
+    put32(out, static_cast<uint32_t>(value & 0xffffffff));
+    put32(out, static_cast<uint32_t>(value >> 32));
+}
+
+uint16_t get16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+uint32_t get32(const uint8_t* p)
+{
+    return get16(p) | (static_cast<uint32_t>(get16(p + 2)) << 16);
+}
+
+uint64_t get64(const uint8_t* p)
+{
+    return get32(p) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+/// <summary>
+/// A run of changed sectors inside a patch file
+/// </summary>
+struct Run {
+    size_t first;
+    size_t count;
+    const uint8_t* data;
+};
+
+}
+
+/// <summary>
+/// Write a patch that turns base into result.
+/// Adjacent changed sectors are stored as one run.
+/// </summary>
+/// <param name="base">image the patch applies to</param>
+/// <param name="result">image the patch produces</param>
+/// <param name="patchfile">patch file to write</param>
+/// <param name="info">gets the size of the patch</param>
+/// <returns>true on success</returns>
+bool makePatch(const D64View& base, const D64View& result, const std::string& patchfile, PatchInfo& info)
+{
+    if (base.tracks() != result.tracks()) {
+        std::cerr << "Error: The images have " << base.tracks() << " and " << result.tracks() << " tracks.\n";
+        return false;
+    }
+
+    auto a = base.bytes();
+    auto b = result.bytes();
+    info = {};
+    info.sectors = sectorCount(base.tracks());
+    info.baseHash = fnv1a(a.data(), a.size());
+    info.resultHash = fnv1a(b.data(), b.size());
+
+    std::string runs;
+    for (size_t sector = 0; sector < static_cast<size_t>(info.sectors);) {
+        if (std::memcmp(&a[sector * SECTOR_SIZE], &b[sector * SECTOR_SIZE], SECTOR_SIZE) == 0) {
+            ++sector;
+            continue;
+        }
+        auto first = sector;
+        while (sector < static_cast<size_t>(info.sectors)
+            && std::memcmp(&a[sector * SECTOR_SIZE], &b[sector * SECTOR_SIZE], SECTOR_SIZE) != 0) {
+            ++sector;
+        }
+        put16(runs, static_cast<uint16_t>(first));
+        put16(runs, static_cast<uint16_t>(sector - first));
+        runs.append(reinterpret_cast<const char*>(&b[first * SECTOR_SIZE]), (sector - first) * SECTOR_SIZE);
+        ++info.runs;
+        info.changed += static_cast<int>(sector - first);
+    }
+
+    std::string out(PATCH_MAGIC, 4);
+    put32(out, PATCH_VERSION);
+    put32(out, static_cast<uint32_t>(info.sectors));
+    put32(out, static_cast<uint32_t>(info.runs));
+    put64(out, info.baseHash);
+    put64(out, info.resultHash);
+    out += runs;
+    put64(out, fnv1a(reinterpret_cast<const uint8_t*>(out.data()), out.size()));
+    info.bytes = out.size();
+
+    // a patch is never seen half written
+    auto temp = patchfile + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        if (!file.write(out.data(), out.size())) {
+            std::cerr << "Error: Could not write patch " << patchfile << ".\n";
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, patchfile, ec);
+    if (ec) {
+        std::cerr << "Error: Could not write patch " << patchfile << ".\n";
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Apply a patch to an image file in place.
+/// The image must hash to the base of the patch and the patched
+/// sectors to its result before anything is written, then only
+/// the sectors of the runs are written.
+/// An image that already is the result is left alone.
+/// </summary>
+/// <param name="diskfile">image file to patch</param>
+/// <param name="patchfile">patch file</param>
+/// <param name="info">gets the contents of the patch</param>
+/// <returns>true if the image is the result of the patch</returns>
+bool applyPatch(const std::string& diskfile, const std::string& patchfile, PatchInfo& info)
+{
+    info = {};
+    std::vector<uint8_t> patch;
+    {
+        std::ifstream in(patchfile, std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "Error: Could not open patch " << patchfile << ".\n";
+            return false;
+        }
+        patch.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    if (patch.size() < HEADER_SIZE + TRAILER_SIZE || std::memcmp(patch.data(), PATCH_MAGIC, 4) != 0
+        || get32(&patch[4]) != PATCH_VERSION
+        || get64(&patch[patch.size() - TRAILER_SIZE]) != fnv1a(patch.data(), patch.size() - TRAILER_SIZE)) {
+        std::cerr << "Error: " << patchfile << " is not a valid patch.\n";
+        return false;
+    }
+    info.bytes = patch.size();
+    info.sectors = static_cast<int>(get32(&patch[8]));
+    info.runs = static_cast<int>(get32(&patch[12]));
+    info.baseHash = get64(&patch[16]);
+    info.resultHash = get64(&patch[24]);
+
+    std::vector<Run> runs;
+    auto offset = HEADER_SIZE;
+    for (auto i = 0; i < info.runs; ++i) {
+        if (offset + RUN_HEADER_SIZE > patch.size() - TRAILER_SIZE) break;
+        Run run{ get16(&patch[offset]), get16(&patch[offset + 2]), &patch[offset + RUN_HEADER_SIZE] };
+        offset += RUN_HEADER_SIZE + run.count * SECTOR_SIZE;
+        if (run.first + run.count > static_cast<size_t>(info.sectors) || offset > patch.size() - TRAILER_SIZE) break;
+        runs.push_back(run);
+        info.changed += static_cast<int>(run.count);
+    }
+    if (runs.size() != static_cast<size_t>(info.runs) || offset != patch.size() - TRAILER_SIZE) {
+        std::cerr << "Error: " << patchfile << " is not a valid patch.\n";
+        return false;
+    }
+
+    // sectors and error bytes, only the sectors are hashed and patched
+    std::vector<uint8_t> image;
+    size_t sectorBytes = 0;
+    {
+        D64View disk;
+        if (!disk.open(diskfile)) {
+            std::cerr << "Error: Could not load disk " << diskfile << ".\n";
+            return false;
+        }
+        if (sectorCount(disk.tracks()) != info.sectors) {
+            std::cerr << "Error: The patch is for an image of " << info.sectors << " sectors, " << diskfile
+                << " has " << sectorCount(disk.tracks()) << ".\n";
+            return false;
+        }
+        image.assign(disk.bytes().begin(), disk.bytes().end());
+        sectorBytes = image.size();
+        image.insert(image.end(), disk.errorBytes().begin(), disk.errorBytes().end());
+    }
+
+    auto hash = fnv1a(image.data(), sectorBytes);
+    if (hash != info.baseHash) {
+        if (hash == info.resultHash) {
+            info.alreadyApplied = true;
+            return true;
+        }
+        std::cerr << "Error: " << diskfile << " is not the image the patch was made for.\n";
+        return false;
+    }
+    for (const auto& run : runs) {
+        std::memcpy(&image[run.first * SECTOR_SIZE], run.data, run.count * SECTOR_SIZE);
+    }
+    if (fnv1a(image.data(), sectorBytes) != info.resultHash) {
+        std::cerr << "Error: " << patchfile << " does not produce the image it was made from.\n";
+        return false;
+    }
+
+    // a container is written as a whole
+    if (isCompressedImage(diskfile)) {
+        if (!writeImageFile(diskfile, image)) {
+            std::cerr << "Error: Could not write " << diskfile << ".\n";
+            return false;
+        }
+        return true;
+    }
+
+    auto fd = ::open(diskfile.c_str(), O_WRONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Could not open " << diskfile << " for writing.\n";
+        return false;
+    }
+    auto ok = true;
+    for (const auto& run : runs) {
+        auto size = run.count * SECTOR_SIZE;
+        ok = ok && pwrite(fd, run.data, size, static_cast<off_t>(run.first * SECTOR_SIZE)) == static_cast<ssize_t>(size);
+    }
+    ok = (::close(fd) == 0) && ok;
+    if (!ok) {
+        std::cerr << "Error: Could not write " << diskfile << ".\n";
+    }
+    return ok;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+#include "d64view.h"
+
+// Sector patch file (.d64p), all numbers little endian.
+//
+//   header:   "D64P", version (u32), sectors of the image (u32),
+//             runs (u32), FNV-1a of the base image (u64),
+//             FNV-1a of the patched image (u64)
+//   run:      first sector (u16), sectors (u16), 256 bytes per sector
+//   trailer:  FNV-1a of everything before it (u64)
+//
+// Sectors are numbered in file order, track 1 sector 0 is sector 0.
+// Error bytes after the sectors of an image are not patched.
+
+/// <summary>
+/// Summary of a patch
+/// </summary>
+struct PatchInfo {
+    int sectors = 0;            // sectors of the image
+    int runs = 0;
+    int changed = 0;            // sectors in the runs
+    size_t bytes = 0;           // size of the patch file
+    uint64_t baseHash = 0;
+    uint64_t resultHash = 0;
+    bool alreadyApplied = false;
+};
+
+bool makePatch(const D64View& base, const D64View& result, const std::string& patchfile, PatchInfo& info);
+bool applyPatch(const std::string& diskfile, const std::string& patchfile, PatchInfo& info);
@@ -0,0 +1,309 @@
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "server.h"
+
+namespace {
+
+const uint32_t MAX_REQUEST = 1 << 20;
+
+// output of the command running on this thread
+thread_local std::string* capturedOut = nullptr;
+thread_local std::string* capturedErr = nullptr;
+
+/// <summary>
+/// Stream buffer for std::cout and std::cerr while serving.
+/// Text written by a thread that runs a client command goes to that
+/// command's response, anything else to the original stream.
+/// </summary>
+class CaptureBuffer : public std::streambuf {
+public:
+    CaptureBuffer(std::streambuf* original, bool error) : original(original), error(error) {}
+
+protected:
+    int overflow(int ch) override
+    {
+        if (ch == traits_type::eof()) {
+            return traits_type::not_eof(ch);
+        }
+        auto c = static_cast<char>(ch);
+        return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        if (auto target = error ? capturedErr : capturedOut) {
+            target->append(s, static_cast<size_t>(n));
+            return n;
+        }
+        std::lock_guard<std::mutex> guard(consoleLock);
+        return original->sputn(s, n);
+    }
+
+    int sync() override
+    {
+        if (!(error ? capturedErr : capturedOut)) {
+            std::lock_guard<std::mutex> guard(consoleLock);
+            return original->pubsync();
+        }
+        return 0;
+    }
+
+private:
+    std::streambuf* original;
+    bool error;
+    static std::mutex consoleLock;
+};
+
+std::mutex CaptureBuffer::consoleLock;
+
+int stopPipe[2] = { -1, -1 };
+
+void onSignal(int)
+{
+    char c = 0;
+    auto ignored = write(stopPipe[1], &c, 1);
+    (void)ignored;
+}
+
+bool readAll(int fd, void* data, size_t size)
+{
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+        auto n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size)
+{
+    auto p = static_cast<const char*>(data);
+    while (size > 0) {
+        auto n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void put32(std::string& out, uint32_t value)
+{
+    for (auto i = 0; i < 4; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+/// <summary>
+/// Wait for the next request of a client
+/// </summary>
+/// <returns>false if the server is stopping or the wait failed</returns>
+bool waitRequest(int fd)
+{
+    for (;;) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        return fds[1].revents == 0;
+    }
+}
+
+/// <summary>
+/// Serve one client until it disconnects or the server stops.
+/// A command that is running when the server stops is finished
+/// and answered.
+/// </summary>
+void serveClient(int fd, const std::function<bool(const std::string& line)>& execute)
+{
+    std::string line, out, err, response;
+    for (;;) {
+        uint8_t header[4];
+        if (!waitRequest(fd) || !readAll(fd, header, sizeof(header))) {
+            break;
+        }
+        auto length = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+        if (length > MAX_REQUEST) {
+            break;
+        }
+        line.resize(length);
+        if (!readAll(fd, line.data(), length)) {
+            break;
+        }
+
+        out.clear();
+        err.clear();
+        capturedOut = &out;
+        capturedErr = &err;
+        auto ok = false;
+        try {
+            ok = execute(line);
+        }
+        catch (const std::exception& e) {
+            err += "Error: ";
+            err += e.what();
+            err += "\n";
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        capturedOut = nullptr;
+        capturedErr = nullptr;
+
+        response.clear();
+        put32(response, ok ? 0 : 1);
+        put32(response, static_cast<uint32_t>(out.size()));
+        put32(response, static_cast<uint32_t>(err.size()));
+        response += out;
+        response += err;
+        if (!writeAll(fd, response.data(), response.size())) {
+            break;
+        }
+    }
+}
+
+}
+
+/// <summary>
+/// Lock of an image, created on first use
+/// </summary>
+/// <param name="key">normalized image path</param>
+std::shared_ptr<std::shared_mutex> ImageLocks::get(const std::string& key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto& mutex = images[key];
+    if (!mutex) {
+        mutex = std::make_shared<std::shared_mutex>();
+    }
+    return mutex;
+}
+
+/// <summary>
+/// Accept clients on a unix domain socket until SIGINT or SIGTERM.
+/// Every client is served on its own thread.
+/// </summary>
+/// <param name="socketPath">socket to create</param>
+/// <param name="execute">runs one command line, returns false if it failed</param>
+/// <returns>exit code</returns>
+int runServer(const std::string& socketPath, const std::function<bool(const std::string& line)>& execute)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: socket path too long: " << socketPath << "\n";
+        return 1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        std::cerr << "Error: unable to create socket: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    // replace a socket left behind, but not one that is in use
+    struct stat st;
+    if (stat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            std::cerr << "Error: a server is already listening on " << socketPath << "\n";
+            close(listener);
+            return 1;
+        }
+        close(listener);
+        unlink(socketPath.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Error: unable to listen on " << socketPath << ": " << strerror(errno) << "\n";
+        close(listener);
+        return 1;
+    }
+
+    if (pipe(stopPipe) != 0) {
+        close(listener);
+        return 1;
+    }
+    struct sigaction action {};
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // commands must not wait for answers on the server's stdin
+    std::cin.setstate(std::ios::failbit);
+
+    CaptureBuffer out(std::cout.rdbuf(), false);
+    CaptureBuffer err(std::cerr.rdbuf(), true);
+    auto originalOut = std::cout.rdbuf(&out);
+    auto originalErr = std::cerr.rdbuf(&err);
+
+    std::cerr << "Listening on " << socketPath << "\n";
+
+    std::mutex clientsLock;
+    std::map<uint64_t, std::thread> threads;
+    std::vector<uint64_t> finished;
+    uint64_t nextId = 0;
+
+    for (;;) {
+        pollfd fds[2] = { { listener, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        auto client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> guard(clientsLock);
+        for (auto id : finished) {
+            threads[id].join();
+            threads.erase(id);
+        }
+        finished.clear();
+
+        auto id = nextId++;
+        threads[id] = std::thread([&, client, id] {
+            serveClient(client, execute);
+            close(client);
+            std::lock_guard<std::mutex> guard(clientsLock);
+            finished.push_back(id);
+        });
+    }
+
+    // no new clients, the stop pipe stays readable so clients waiting
+    // for a request leave and running commands finish and are answered
+    close(listener);
+    unlink(socketPath.c_str());
+    for (auto& [id, thread] : threads) {
+        thread.join();
+    }
+
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+
+    std::cerr << "Server stopped\n";
+    std::cout.rdbuf(originalOut);
+    std::cerr.rdbuf(originalErr);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+// Protocol of --serve over a unix domain socket.
+// All numbers are 32 bit little endian.
+//
+//   request:   length, command line of length bytes
+//              (the same commands and quoting as the interactive shell)
+//   response:  status (0 ok, 1 failed), stdout length, stderr length,
+//              stdout bytes, stderr bytes
+//
+// A connection can send any number of requests. Each connection has
+// its own current disk, set by load or by naming a disk.
+
+/// <summary>
+/// Reader/writer locks of the images used by server clients.
+/// Commands on one image take its lock shared to read or exclusive
+/// to modify it, and the global lock shared. Commands that work on
+/// many images take the global lock exclusive.
+/// </summary>
+class ImageLocks {
+public:
+    std::shared_ptr<std::shared_mutex> get(const std::string& key);
+    std::shared_mutex& global() { return all; }
+
+private:
+    std::mutex lock;
+    std::map<std::string, std::shared_ptr<std::shared_mutex>> images;
+    std::shared_mutex all;
+};
+
+int runServer(const std::string& socketPath, const std::function<bool(const std::string& line)>& execute);
@@ -0,0 +1,673 @@
+#include <iostream>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "d64view.h"
+#include "d64z.h"
+#include "stats.h"
+
+/// <summary>
+/// Index the directory of a disk
+/// </summary>
+/// <param name="disk">disk to index</param>
+void DirectoryIndex::build(d64& disk)
+{
+    names.clear();
+    auto used = 0;
+    for (const auto& entry : disk.directory()) {
+        names[d64::Trim(entry.file_name)] = { entry.file_size[0] + entry.file_size[1] * 256 };
+        ++used;
+    }
+    blocksFree = disk.getFreeSectorCount();
+    slotsFree = DIRECTORY_SLOTS - used;
+}
+
+/// <summary>
+/// Look up a file by name
+/// </summary>
+/// <param name="name">file name</param>
+/// <returns>the entry or nullptr</returns>
+const DirectoryIndex::Entry* DirectoryIndex::find(const std::string& name) const
+{
+    auto it = names.find(name);
+    return it == names.end() ? nullptr : &it->second;
+}
+
+/// <summary>
+/// Record a file added to the disk
+/// </summary>
+/// <param name="name">file name</param>
+/// <param name="blocks">blocks used by the file</param>
+void DirectoryIndex::add(const std::string& name, int blocks)
+{
+    names[name] = { blocks };
+    blocksFree -= blocks;
+    --slotsFree;
+}
+
+/// <summary>
+/// Record a file removed from the disk
+/// </summary>
+/// <param name="name">file name</param>
+void DirectoryIndex::remove(const std::string& name)
+{
+    auto it = names.find(name);
+    if (it != names.end()) {
+        blocksFree += it->second.blocks;
+        ++slotsFree;
+        names.erase(it);
+    }
+}
+
+/// <summary>
+/// Record a renamed file
+/// </summary>
+/// <param name="oldname">current name</param>
+/// <param name="newname">new name</param>
+void DirectoryIndex::rename(const std::string& oldname, const std::string& newname)
+{
+    auto it = names.find(oldname);
+    if (it != names.end()) {
+        auto entry = it->second;
+        names.erase(it);
+        names[newname] = entry;
+    }
+}
+
+/// <summary>
+/// Read the stamp of a file
+/// </summary>
+/// <param name="path">file</param>
+/// <returns>false if the file does not exist</returns>
+bool FileStamp::read(const std::string& path)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    device = st.st_dev;
+    inode = st.st_ino;
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+/// <summary>
+/// Make path the resident image.
+/// If it is already resident nothing is read from disk.
+/// A different dirty image is written back first.
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>true on success</returns>
+bool DiskSession::open(const std::string& path)
+{
+    if (isOpen() && path == filename) {
+        return true;
+    }
+    if (!flush()) {
+        return false;
+    }
+    close();
+
+    // stamp first, a change while loading makes the image stale
+    if (!stamp.read(path) || !loadImage(image, path, &errors)) {
+        return false;
+    }
+    filename = path;
+    indexed = false;
+    saved = imageBytes(image);
+    lastSave = std::chrono::steady_clock::now();
+    return true;
+}
+
+/// <summary>
+/// Format a new image, write it and make it the resident image
+/// </summary>
+/// <param name="path">image file</param>
+/// <param name="type">35 or 40 track disk</param>
+/// <param name="name">disk name</param>
+/// <returns>true on success</returns>
+bool DiskSession::create(const std::string& path, diskType type, const std::string& name)
+{
+    if (!flush()) {
+        return false;
+    }
+    close();
+
+    image = d64(type);
+    image.formatDisk(name);
+    filename = path;
+    indexed = false;
+    saved.clear();
+    errors.clear();
+    dirty = true;
+    if (!save()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+/// <summary>
+/// Directory index of the resident image, built on first use
+/// </summary>
+DirectoryIndex& DiskSession::index()
+{
+    if (!indexed) {
+        directory.build(image);
+        indexed = true;
+    }
+    return directory;
+}
+
+/// <summary>
+/// Add a file and update the index
+/// </summary>
+/// <param name="name">file name</param>
+/// <param name="type">file type</param>
+/// <param name="data">file contents</param>
+/// <returns>true on success</returns>
+bool DiskSession::addFile(const std::string& name, FileTypes type, const std::vector<uint8_t>& data)
+{
+    if (!image.addFile(name, type, data)) {
+        indexed = false;
+        return false;
+    }
+    if (indexed) {
+        directory.add(name, fileBlocks(data.size()));
+    }
+    return true;
+}
+
+/// <summary>
+/// Remove a file and update the index
+/// </summary>
+/// <param name="name">file name</param>
+/// <returns>true on success</returns>
+bool DiskSession::removeFile(const std::string& name)
+{
+    if (!image.removeFile(name)) {
+        return false;
+    }
+    if (indexed) {
+        directory.remove(name);
+    }
+    return true;
+}
+
+/// <summary>
+/// Rename a file and update the index
+/// </summary>
+/// <param name="oldname">current name</param>
+/// <param name="newname">new name</param>
+/// <returns>true on success</returns>
+bool DiskSession::renameFile(const std::string& oldname, const std::string& newname)
+{
+    if (!image.renameFile(oldname, newname)) {
+        return false;
+    }
+    if (indexed) {
+        directory.rename(oldname, newname);
+    }
+    return true;
+}
+
+/// <summary>
+/// Return true if the file is still the one the image was loaded
+/// from or last saved to
+/// </summary>
+bool DiskSession::isCurrent() const
+{
+    FileStamp now;
+    return isOpen() && now.read(filename) && now == stamp;
+}
+
+/// <summary>
+/// Approximate memory used by the image, its saved copy and the index
+/// </summary>
+size_t DiskSession::memoryUsage() const
+{
+    return 2 * saved.size() + errors.size() + directory.entries().size() * 64 + sizeof(*this);
+}
+
+/// <summary>
+/// Drop the resident image without saving
+/// </summary>
+void DiskSession::close()
+{
+    filename.clear();
+    saved.clear();
+    errors.clear();
+    indexed = false;
+    dirty = false;
+}
+
+/// <summary>
+/// Record a modification of the resident image
+/// </summary>
+/// <returns>false if an immediate save failed</returns>
+bool DiskSession::commit()
+{
+    dirty = true;
+    if (!deferred) {
+        return save();
+    }
+    if (autosave.count() > 0 && std::chrono::steady_clock::now() - lastSave >= autosave) {
+        return save();
+    }
+    return true;
+}
+
+/// <summary>
+/// Write the resident image to its file
+/// </summary>
+/// <returns>true on success</returns>
+bool DiskSession::save()
+{
+    PhaseTimer timer(save_phase);
+    if (!isOpen()) {
+        return false;
+    }
+
+    auto current = imageBytes(image);
+    if (!saveSectors(current)) {
+        // new file or different geometry, write the whole image
+        if (!saveImage(image, filename, errors)) {
+            std::cerr << "Error: Failed to save disk " << filename << ".\n";
+            return false;
+        }
+        lastSaveSectors = static_cast<int>(current.size() / SECTOR_SIZE);
+    }
+    saved = std::move(current);
+    stamp.read(filename);
+    dirty = false;
+    lastSave = std::chrono::steady_clock::now();
+    return true;
+}
+
+/// <summary>
+/// Write the changed sectors in place
+/// </summary>
+/// <param name="current">sectors of the resident image</param>
+/// <returns>false if the file has to be rewritten</returns>
+bool DiskSession::saveSectors(const std::vector<uint8_t>& current)
+{
+    // a container is always written as a whole
+    if (saved.size() != current.size() || isCompressedImage(filename)) {
+        return false;
+    }
+
+    // the file must be the one the sectors were read from, with the same layout
+    FileStamp now;
+    auto sectors = current.size() / SECTOR_SIZE;
+    if (!now.read(filename) || now != stamp
+        || (now.size != sectors * SECTOR_SIZE && now.size != sectors * (SECTOR_SIZE + 1))) {
+        return false;
+    }
+
+    auto fd = ::open(filename.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto count = 0;
+    auto ok = true;
+    for (size_t offset = 0; offset < current.size() && ok; offset += SECTOR_SIZE) {
+        if (std::memcmp(&current[offset], &saved[offset], SECTOR_SIZE) != 0) {
+            ok = pwrite(fd, &current[offset], SECTOR_SIZE, offset) == SECTOR_SIZE;
+            ++count;
+        }
+    }
+    ok = (::close(fd) == 0) && ok;
+
+    countImageWritten(static_cast<uint64_t>(count), static_cast<uint64_t>(count) * SECTOR_SIZE);
+    lastSaveSectors = count;
+    return ok;
+}
+
+/// <summary>
+/// Write the resident image if it has unsaved changes
+/// </summary>
+/// <returns>true on success</returns>
+bool DiskSession::flush()
+{
+    return dirty ? save() : true;
+}
+
+/// <summary>
+/// Normalized path used to identify an image
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>key for the pool</returns>
+std::string SessionPool::key(const std::string& path)
+{
+    std::error_code ec;
+    auto full = std::filesystem::absolute(path, ec);
+    return ec ? path : full.lexically_normal().string();
+}
+
+/// <summary>
+/// Get the resident image for path, loading it on first use
+/// or when its file changed since it was loaded
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>session or nullptr if the image could not be loaded</returns>
+std::shared_ptr<DiskSession> SessionPool::open(const std::string& path)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    auto k = key(path);
+    wait(guard, k);
+    auto it = images.find(k);
+    if (it != images.end()) {
+        // unsaved changes are kept even if the file changed
+        if (it->second.session->isDirty() || it->second.session->isCurrent()) {
+            ++counters.hits;
+            use(it->second);
+            return it->second.session;
+        }
+        ++counters.stale;
+        erase(it);
+    }
+
+    ++counters.misses;
+    auto image = std::make_shared<DiskSession>();
+    image->setDeferred(deferred);
+    image->setAutosaveInterval(autosave);
+    pending.insert(k);
+    guard.unlock();
+
+    auto loaded = image->open(path);
+
+    guard.lock();
+    pending.erase(k);
+    settled.notify_all();
+    if (!loaded) {
+        return nullptr;
+    }
+    image = insert(k, std::move(image));
+    auto evicted = trim(k);
+    guard.unlock();
+    writeBack(std::move(evicted));
+    return image;
+}
+
+/// <summary>
+/// Get the resident image for path without loading it
+/// </summary>
+/// <param name="path">image file</param>
+/// <returns>session or nullptr if the image is not resident or its file changed</returns>
+std::shared_ptr<DiskSession> SessionPool::find(const std::string& path)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    auto k = key(path);
+    wait(guard, k);
+    auto it = images.find(k);
+    if (it == images.end()) {
+        return nullptr;
+    }
+    if (!it->second.session->isDirty() && !it->second.session->isCurrent()) {
+        ++counters.stale;
+        erase(it);
+        return nullptr;
+    }
+    ++counters.hits;
+    use(it->second);
+    return it->second.session;
+}
+
+/// <summary>
+/// Format a new image and make it resident
+/// </summary>
+/// <param name="path">image file</param>
+/// <param name="type">35 or 40 track disk</param>
+/// <param name="name">disk name</param>
+/// <returns>session or nullptr on failure</returns>
+std::shared_ptr<DiskSession> SessionPool::create(const std::string& path, diskType type, const std::string& name)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    auto k = key(path);
+    wait(guard, k);
+    auto it = images.find(k);
+    if (it != images.end()) {
+        erase(it);
+    }
+
+    auto image = std::make_shared<DiskSession>();
+    image->setDeferred(deferred);
+    image->setAutosaveInterval(autosave);
+    pending.insert(k);
+    guard.unlock();
+
+    auto created = image->create(path, type, name);
+
+    guard.lock();
+    pending.erase(k);
+    settled.notify_all();
+    if (!created) {
+        return nullptr;
+    }
+    image = insert(k, std::move(image));
+    auto evicted = trim(k);
+    guard.unlock();
+    writeBack(std::move(evicted));
+    return image;
+}
+
+/// <summary>
+/// Drop a resident image without saving it
+/// </summary>
+/// <param name="path">image file</param>
+void SessionPool::close(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = images.find(key(path));
+    if (it != images.end()) {
+        erase(it);
+    }
+}
+
+/// <summary>
+/// Drop all resident images without saving them
+/// </summary>
+void SessionPool::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    images.clear();
+    recent.clear();
+}
+
+/// <summary>
+/// Wait until an image is no longer loaded or written back by another thread
+/// </summary>
+/// <param name="guard">holds the pool lock</param>
+/// <param name="k">key of the image</param>
+void SessionPool::wait(std::unique_lock<std::mutex>& guard, const std::string& k)
+{
+    settled.wait(guard, [&] { return pending.count(k) == 0; });
+}
+
+/// <summary>
+/// Make a loaded image resident as the most recently used one
+/// </summary>
+std::shared_ptr<DiskSession> SessionPool::insert(const std::string& k, std::shared_ptr<DiskSession> session)
+{
+    auto it = images.find(k);
+    if (it != images.end()) {
+        erase(it);
+    }
+    recent.push_front(k);
+    auto& resident = images[k];
+    resident = { std::move(session), recent.begin() };
+    return resident.session;
+}
+
+/// <summary>
+/// Drop a resident image without saving it
+/// </summary>
+void SessionPool::erase(std::map<std::string, Resident>::iterator it)
+{
+    recent.erase(it->second.recent);
+    images.erase(it);
+}
+
+/// <summary>
+/// Mark an image as the most recently used one
+/// </summary>
+void SessionPool::use(Resident& resident)
+{
+    recent.splice(recent.begin(), recent, resident.recent);
+}
+
+/// <summary>
+/// Take the least recently used images out of the pool until it is
+/// below its memory limit. Images that are in use stay resident.
+/// The images taken out are pending until writeBack saved them.
+/// </summary>
+/// <param name="keep">image that was just used</param>
+/// <returns>images to pass to writeBack once the pool lock is released</returns>
+SessionPool::Evicted SessionPool::trim(const std::string& keep)
+{
+    size_t bytes = 0;
+    for (const auto& [k, resident] : images) {
+        bytes += resident.session->memoryUsage();
+    }
+
+    Evicted evicted;
+    for (auto k = recent.end(); k != recent.begin() && bytes > limit;) {
+        --k;
+        auto it = images.find(*k);
+        if (*k == keep || it->second.session.use_count() > 1) {
+            continue;
+        }
+        bytes -= it->second.session->memoryUsage();
+        pending.insert(*k);
+        evicted.emplace_back(*k, std::move(it->second.session));
+        k = recent.erase(k);
+        images.erase(it);
+    }
+    return evicted;
+}
+
+/// <summary>
+/// Write back the modified images taken out by trim.
+/// Called without the pool lock. An image that fails to save is
+/// made resident again as the least recently used one.
+/// </summary>
+/// <param name="evicted">images taken out of the pool</param>
+void SessionPool::writeBack(Evicted evicted)
+{
+    if (evicted.empty()) {
+        return;
+    }
+    std::vector<bool> saved;
+    for (auto& [k, session] : evicted) {
+        saved.push_back(session->flush());
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < evicted.size(); ++i) {
+        auto& [k, session] = evicted[i];
+        pending.erase(k);
+        if (saved[i]) {
+            ++counters.evictions;
+        }
+        else if (images.find(k) == images.end()) {
+            recent.push_back(k);
+            images[k] = { std::move(session), std::prev(recent.end()) };
+        }
+    }
+    settled.notify_all();
+}
+
+/// <summary>
+/// Write every image with unsaved changes
+/// </summary>
+/// <returns>true if all saves succeeded</returns>
+bool SessionPool::flush()
+{
+    // holding the sessions keeps them from being evicted while they are written
+    std::vector<std::shared_ptr<DiskSession>> sessions;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& [k, resident] : images) {
+            sessions.push_back(resident.session);
+        }
+    }
+    auto ok = true;
+    for (auto& session : sessions) {
+        ok = session->flush() && ok;
+    }
+    return ok;
+}
+
+/// <summary>
+/// Return true if any resident image has unsaved changes
+/// </summary>
+bool SessionPool::isDirty() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (const auto& [k, resident] : images) {
+        if (resident.session->isDirty()) return true;
+    }
+    return false;
+}
+
+/// <summary>
+/// Defer saves of all current and future images
+/// </summary>
+/// <param name="defer">true to save only on flush or autosave</param>
+void SessionPool::setDeferred(bool defer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    deferred = defer;
+    for (auto& [k, resident] : images) {
+        resident.session->setDeferred(defer);
+    }
+}
+
+/// <summary>
+/// Set the autosave interval of all current and future images
+/// </summary>
+/// <param name="seconds">seconds between saves, 0 for none</param>
+void SessionPool::setAutosaveInterval(int seconds)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    autosave = seconds;
+    for (auto& [k, resident] : images) {
+        resident.session->setAutosaveInterval(seconds);
+    }
+}
+
+/// <summary>
+/// Set the memory the resident images may use.
+/// The most recently used image always stays resident.
+/// </summary>
+/// <param name="bytes">memory limit</param>
+void SessionPool::setMemoryLimit(size_t bytes)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    limit = bytes;
+    auto evicted = trim(recent.empty() ? std::string() : recent.front());
+    guard.unlock();
+    writeBack(std::move(evicted));
+}
+
+/// <summary>
+/// Cache counters and current memory use
+/// </summary>
+CacheStats SessionPool::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto result = counters;
+    result.images = images.size();
+    result.limit = limit;
+    for (const auto& [k, resident] : images) {
+        result.bytes += resident.session->memoryUsage();
+    }
+    return result;
+}
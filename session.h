@@ -0,0 +1,184 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "d64.h"
+
+/// <summary>
+/// Hashed index of a disk directory with cached free space.
+/// Kept current through add, remove and rename so name lookups
+/// and space checks do not scan the directory or the BAM.
+/// </summary>
+class DirectoryIndex {
+public:
+    struct Entry {
+        int blocks;
+    };
+
+    void build(d64& disk);
+    const Entry* find(const std::string& name) const;
+    void add(const std::string& name, int blocks);
+    void remove(const std::string& name);
+    void rename(const std::string& oldname, const std::string& newname);
+
+    const std::unordered_map<std::string, Entry>& entries() const { return names; }
+    int freeBlocks() const { return blocksFree; }
+    int freeSlots() const { return slotsFree; }
+
+private:
+    std::unordered_map<std::string, Entry> names;
+    int blocksFree = 0;
+    int slotsFree = 0;
+};
+
+/// <summary>
+/// Identity of an image file as seen by stat.
+/// A resident image is only reused while its file still has the
+/// stamp it had when it was loaded or last saved.
+/// </summary>
+struct FileStamp {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;          // nanoseconds
+
+    bool read(const std::string& path);
+    bool operator==(const FileStamp& other) const = default;
+};
+
+/// <summary>
+/// A d64 image kept resident in memory between commands.
+/// Mutating commands call commit() which marks the image dirty and
+/// writes it back unless saves are deferred (interactive shell).
+/// Deferred images are written on save(), flush() or when the
+/// autosave interval has elapsed.
+/// A copy of the sectors as they are on disk is kept so a save
+/// only writes the sectors that changed.
+/// </summary>
+class DiskSession {
+public:
+    bool open(const std::string& path);
+    bool create(const std::string& path, diskType type, const std::string& name);
+    void close();
+
+    bool commit();
+    bool save();
+    bool flush();
+
+    d64& disk() { return image; }
+    const std::vector<uint8_t>& errorBytes() const { return errors; }
+    DirectoryIndex& index();
+    void invalidate() { indexed = false; }
+
+    bool exists(const std::string& name) { return index().find(name) != nullptr; }
+    bool addFile(const std::string& name, FileTypes type, const std::vector<uint8_t>& data);
+    bool removeFile(const std::string& name);
+    bool renameFile(const std::string& oldname, const std::string& newname);
+
+    const std::string& path() const { return filename; }
+    bool isOpen() const { return !filename.empty(); }
+    bool isDirty() const { return dirty; }
+    bool isCurrent() const;
+    int sectorsWritten() const { return lastSaveSectors; }
+    size_t memoryUsage() const;
+
+    void setDeferred(bool defer) { deferred = defer; }
+    void setAutosaveInterval(int seconds) { autosave = std::chrono::seconds(seconds); }
+
+private:
+    bool saveSectors(const std::vector<uint8_t>& current);
+
+    d64 image;
+    std::string filename;
+    std::vector<uint8_t> saved;     // sectors as they are in the file
+    std::vector<uint8_t> errors;    // error bytes after the sectors, empty if the file has none
+    FileStamp stamp;                // the file when it was loaded or saved
+    int lastSaveSectors = 0;
+    DirectoryIndex directory;
+    bool indexed = false;
+    bool dirty = false;
+    bool deferred = false;
+    std::chrono::seconds autosave{ 0 };
+    std::chrono::steady_clock::time_point lastSave;
+};
+
+/// <summary>
+/// Counters of the image cache
+/// </summary>
+struct CacheStats {
+    uint64_t hits = 0;          // resident image reused
+    uint64_t misses = 0;        // image loaded from its file
+    uint64_t stale = 0;         // resident image dropped because its file changed
+    uint64_t evictions = 0;     // image dropped to stay below the memory limit
+    size_t images = 0;
+    size_t bytes = 0;
+    size_t limit = 0;
+};
+
+/// <summary>
+/// Resident images keyed by path, least recently used first out.
+/// Each image is loaded once and stays in memory while its file is
+/// unchanged, so a sequence of commands against it costs one load
+/// and, when saves are deferred, one save from flush().
+/// A clean image whose file changed on disk is loaded again.
+/// When the images use more than the memory limit the least
+/// recently used ones are written back if needed and dropped.
+/// Sessions are shared, an image in use is never evicted.
+/// The pool may be used from several threads, access to a session
+/// itself has to be serialized by the caller. Images are loaded and
+/// written back outside the pool lock; other threads asking for an
+/// image that is being loaded or evicted wait for that image only.
+/// </summary>
+class SessionPool {
+public:
+    static const size_t DEFAULT_LIMIT = 64 << 20;
+
+    std::shared_ptr<DiskSession> open(const std::string& path);
+    std::shared_ptr<DiskSession> find(const std::string& path);
+    std::shared_ptr<DiskSession> create(const std::string& path, diskType type, const std::string& name);
+    void close(const std::string& path);
+    void clear();
+
+    bool flush();
+    bool isDirty() const;
+
+    void setDeferred(bool defer);
+    void setAutosaveInterval(int seconds);
+    void setMemoryLimit(size_t bytes);
+    CacheStats stats() const;
+
+    static std::string key(const std::string& path);
+
+private:
+    struct Resident {
+        std::shared_ptr<DiskSession> session;
+        std::list<std::string>::iterator recent;
+    };
+
+    using Evicted = std::vector<std::pair<std::string, std::shared_ptr<DiskSession>>>;
+
+    void wait(std::unique_lock<std::mutex>& guard, const std::string& k);
+    std::shared_ptr<DiskSession> insert(const std::string& k, std::shared_ptr<DiskSession> session);
+    void erase(std::map<std::string, Resident>::iterator it);
+    void use(Resident& resident);
+    Evicted trim(const std::string& keep);
+    void writeBack(Evicted evicted);
+
+    mutable std::mutex lock;
+    std::condition_variable settled;    // an image left pending
+    std::map<std::string, Resident> images;
+    std::set<std::string> pending;      // images being loaded or written back
+    std::list<std::string> recent;      // most recently used first
+    size_t limit = DEFAULT_LIMIT;
+    CacheStats counters;
+    bool deferred = false;
+    int autosave = 0;
+};
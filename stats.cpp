@@ -0,0 +1,230 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include <sys/resource.h>
+
+#include "stats.h"
+
+namespace {
+
+std::atomic<bool> enabled{ false };
+std::atomic<bool> countingAllocations{ false };
+std::chrono::steady_clock::time_point startTime;
+
+std::atomic<int64_t> phaseTime[phase_count];     // nanoseconds
+std::atomic<uint64_t> sectorsRead{ 0 }, sectorsWritten{ 0 };
+std::atomic<uint64_t> imageBytesRead{ 0 }, imageBytesWritten{ 0 };
+std::atomic<uint64_t> hostBytesRead{ 0 }, hostBytesWritten{ 0 };
+std::atomic<uint64_t> allocations{ 0 }, allocationBytes{ 0 };
+
+// innermost running timer of this thread
+thread_local PhaseTimer* currentTimer = nullptr;
+
+const char* phaseNames[phase_count] = { "parse", "load", "operation", "save", "host_io" };
+
+void addTime(StatsPhase phase, std::chrono::steady_clock::duration time)
+{
+    phaseTime[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+std::string milliseconds(int64_t ns)
+{
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", static_cast<double>(ns) / 1e6);
+    return text;
+}
+
+}
+
+/// <summary>
+/// Start collecting statistics.
+/// The time since the start of the run is counted as parsing.
+/// </summary>
+/// <param name="started">start of the run</param>
+void enableStats(std::chrono::steady_clock::time_point started)
+{
+    startTime = started;
+    addTime(parse_phase, std::chrono::steady_clock::now() - started);
+    enabled = true;
+    enableAllocationCount();
+}
+
+bool statsEnabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+/// <summary>
+/// Count an image read from its file
+/// </summary>
+/// <param name="sectors">sectors of the image</param>
+/// <param name="bytes">bytes of the file</param>
+void countImageRead(uint64_t sectors, uint64_t bytes)
+{
+    sectorsRead += sectors;
+    imageBytesRead += bytes;
+}
+
+/// <summary>
+/// Count sectors written to an image file
+/// </summary>
+/// <param name="sectors">sectors written</param>
+/// <param name="bytes">bytes written to the file</param>
+void countImageWritten(uint64_t sectors, uint64_t bytes)
+{
+    sectorsWritten += sectors;
+    imageBytesWritten += bytes;
+}
+
+void countHostRead(uint64_t bytes)
+{
+    hostBytesRead += bytes;
+}
+
+void countHostWritten(uint64_t bytes)
+{
+    hostBytesWritten += bytes;
+}
+
+/// <summary>
+/// Count heap allocations without the other statistics, for d64bench
+/// </summary>
+void enableAllocationCount()
+{
+    countingAllocations = true;
+}
+
+uint64_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t allocatedBytes()
+{
+    return allocationBytes.load(std::memory_order_relaxed);
+}
+
+// The global allocation functions are replaced to count heap
+// allocations. Every delete forwards to the plain one, so the only
+// allocation and release are the malloc and free below.
+void* operator new(std::size_t size)
+{
+    if (countingAllocations.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+/// <summary>
+/// Print the statistics of the run
+/// </summary>
+/// <param name="os">stream to write to, stderr</param>
+/// <param name="format">json, anything else prints text</param>
+void printStats(std::ostream& os, OutputFormat format)
+{
+    auto total = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto peakKB = static_cast<size_t>(usage.ru_maxrss);
+
+    struct Counter {
+        const char* name;
+        uint64_t value;
+    };
+    const Counter counters[] = {
+        { "sectors_read", sectorsRead },
+        { "sectors_written", sectorsWritten },
+        { "image_bytes_read", imageBytesRead },
+        { "image_bytes_written", imageBytesWritten },
+        { "host_bytes_read", hostBytesRead },
+        { "host_bytes_written", hostBytesWritten },
+        { "allocations", allocations },
+        { "allocated_bytes", allocationBytes },
+        { "peak_rss_kb", peakKB },
+    };
+
+    OutputBuffer out(format);
+    if (out.json()) {
+        out << "{\"phases_ms\":{";
+        for (auto phase = 0; phase < phase_count; ++phase) {
+            out << (phase ? "," : "") << '"' << phaseNames[phase] << "\":" << milliseconds(phaseTime[phase]);
+        }
+        out << "},\"total_ms\":" << milliseconds(total);
+        for (const auto& counter : counters) {
+            out << ",\"" << counter.name << "\":" << static_cast<size_t>(counter.value);
+        }
+        out << "}\n";
+    }
+    else {
+        // name, value right aligned at column 32
+        auto line = [&](const std::string& name, const std::string& value) {
+            out << "  " << name;
+            out.pad(value, 30 - name.size()) << "\n";
+        };
+        out << "Stats:\n";
+        for (auto phase = 0; phase < phase_count; ++phase) {
+            line(std::string(phaseNames[phase]) + " ms", milliseconds(phaseTime[phase]));
+        }
+        line("total ms", milliseconds(total));
+        for (const auto& counter : counters) {
+            line(counter.name, std::to_string(counter.value));
+        }
+    }
+    out.flush(os);
+}
+
+PhaseTimer::PhaseTimer(StatsPhase phase) : phase(phase)
+{
+    if (!statsEnabled()) {
+        return;
+    }
+    active = true;
+    outer = currentTimer;
+    currentTimer = this;
+    begin = std::chrono::steady_clock::now();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if (!active) {
+        return;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    addTime(phase, elapsed - nested);
+    if (outer) {
+        outer->nested += elapsed;
+    }
+    currentTimer = outer;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+#include "output.h"
+
+/// <summary>
+/// Phases of a run measured by --stats
+/// </summary>
+enum StatsPhase {
+    parse_phase,        // command line parsing
+    load_phase,         // reading and unpacking image files
+    operation_phase,    // everything not in another phase
+    save_phase,         // writing image files
+    host_io_phase,      // reading and writing host files
+    phase_count
+};
+
+void enableStats(std::chrono::steady_clock::time_point started);
+bool statsEnabled();
+
+void countImageRead(uint64_t sectors, uint64_t bytes);
+void countImageWritten(uint64_t sectors, uint64_t bytes);
+void countHostRead(uint64_t bytes);
+void countHostWritten(uint64_t bytes);
+void enableAllocationCount();
+uint64_t allocationCount();
+uint64_t allocatedBytes();
+
+void printStats(std::ostream& os, OutputFormat format);
+
+/// <summary>
+/// Adds the time until it goes out of scope to a phase.
+/// Time spent in a timer started on the same thread while this one
+/// runs goes to the inner phase only, so the phases of a run add up
+/// to its wall time. Does nothing unless --stats is used.
+/// </summary>
+class PhaseTimer {
+public:
+    explicit PhaseTimer(StatsPhase phase);
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    StatsPhase phase;
+    bool active = false;
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::duration nested{ 0 };
+    PhaseTimer* outer = nullptr;
+};
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Backup of generated images: the volumes hold every planned file,
+# match the dry run plan and pass verify. A file too large for a volume
+# fails the backup.
+# usage: backup_plan.sh path/to/d64cli
+set -eu
+d64cli=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$d64cli" generate src --count 6 --seed 7 > /dev/null
+"$d64cli" backup bk.d64 --disks src/*.d64 --dry-run < /dev/null > plan.txt
+"$d64cli" backup bk.d64 --disks src/*.d64 < /dev/null > backup.txt
+
+planned=$(sed -n 's/^Backup plan: \([0-9]*\) files.* on \([0-9]*\) volumes$/\1 \2/p' plan.txt)
+[ -n "$planned" ] || fail "no plan"
+set -- $planned
+files=$1
+volumes=$2
+[ "$volumes" -gt 1 ] || fail "expected several volumes, got $volumes"
+grep -q "^Backup plan: $files files" backup.txt || fail "backup does not follow the dry run plan"
+
+found=0
+for volume in bk*.d64; do
+    count=$("$d64cli" list "$volume" | grep -c ' [A-Z][A-Z][A-Z] [0-9]* sectors$' || true)
+    expected=$(sed -n "s|^$volume: \([0-9]*\) files.*|\1|p" plan.txt)
+    [ "$count" = "$expected" ] || fail "$volume has $count files, planned $expected"
+    "$d64cli" verify "$volume" > /dev/null || fail "$volume does not verify"
+    found=$((found + count))
+done
+[ "$(ls bk*.d64 | wc -l)" -eq "$volumes" ] || fail "expected $volumes volumes"
+[ "$found" -eq "$files" ] || fail "volumes hold $found files, planned $files"
+
+"$d64cli" create big.d64 --tracks 40 < /dev/null > /dev/null
+head -c 175000 /dev/urandom > huge.prg
+"$d64cli" add big.d64 huge.prg > /dev/null
+if "$d64cli" backup huge.d64 --disks big.d64 src/*.d64 < /dev/null > huge.txt 2>&1; then
+    fail "backup with a file too large for a volume succeeded"
+fi
+grep -q "is too large for a backup volume" huge.txt || fail "no error for the large file"
+! grep -q "^Backup complete" huge.txt || fail "incomplete backup reported complete"
+echo "backup plan: $files files on $volumes volumes"
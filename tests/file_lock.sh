@@ -0,0 +1,58 @@
+#!/bin/sh
+# Commands of another process wait for an image that a shell holds
+# locked with unsaved changes, or fail with --lock-timeout 0; scan
+# leaves the image for its next run.
+# usage: file_lock.sh path/to/d64cli
+set -eu
+d64cli=$1
+work=$(mktemp -d)
+shell=
+trap '[ -z "$shell" ] || kill "$shell" 2> /dev/null || true; rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+locked() { grep -q "is locked by another process" "$1"; }
+
+"$d64cli" generate img --count 2 --seed 9 > /dev/null
+held=img/disk00001.d64
+printf 'held by the shell' > held.seq
+printf 'added after the wait' > late.seq
+
+# the shell keeps the image locked until its change is saved on exit
+(echo "add $held held.seq"; sleep 4; echo "exit") | "$d64cli" --interactive > shell.txt 2>&1 &
+shell=$!
+tries=0
+while "$d64cli" list "$held" --lock-timeout 0 > /dev/null 2>&1; do
+    tries=$((tries + 1))
+    [ "$tries" -lt 40 ] || fail "the shell did not lock $held"
+    sleep 0.05
+done
+
+if "$d64cli" add "$held" late.seq --lock-timeout 0 > add.txt 2>&1; then fail "add did not see the lock"; fi
+locked add.txt || fail "add: no lock error"
+if "$d64cli" list "$held" --lock-timeout 0 > list.txt 2>&1; then fail "list did not see the lock"; fi
+locked list.txt || fail "list: no lock error"
+
+"$d64cli" verify img --lock-timeout 0 --format json > verify.json || true
+grep -q '"locked":1,' verify.json || fail "verify of many images did not report the locked image"
+
+"$d64cli" generate img --count 2 --seed 9 --lock-timeout 0 > generate.txt 2>&1 || true
+locked generate.txt || fail "generate replaced a locked image"
+
+"$d64cli" backup "$held" --disks img/disk00002.d64 --lock-timeout 0 < /dev/null > backup.txt 2>&1 || true
+locked backup.txt || fail "backup wrote to a locked image"
+
+"$d64cli" scan img --lock-timeout 0 > scan.txt || fail "scan failed"
+grep -q "^1 images locked by another process" scan.txt || fail "scan read a locked image"
+
+# waits until the shell saved and released the image
+"$d64cli" add "$held" late.seq --lock-timeout 30 > /dev/null || fail "add did not wait for the lock"
+wait "$shell" || true
+shell=
+"$d64cli" list "$held" > list.txt
+grep -q ' HELD ' list.txt || fail "the change of the shell was lost"
+grep -q ' LATE ' list.txt || fail "the waiting add was lost"
+"$d64cli" scan img > scan.txt || fail "scan failed"
+grep -q "(1 new or changed, 1 unchanged" scan.txt || fail "scan did not pick up the image it skipped"
+echo "file locks: conflicts reported, waiting add kept both changes"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# generate is deterministic: the same seed gives the same images,
+# image n does not depend on the count, another seed differs.
+# usage: generate_seed.sh path/to/d64cli
+set -eu
+d64cli=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$d64cli" generate a --count 8 --seed 42 --corrupt 50 > a.txt
+"$d64cli" generate b --count 8 --seed 42 --corrupt 50 > b.txt
+"$d64cli" generate c --count 3 --seed 42 --corrupt 50 > /dev/null
+"$d64cli" generate d --count 8 --seed 43 --corrupt 50 > /dev/null
+
+[ "$(ls a | wc -l)" -eq 8 ] || fail "expected 8 images"
+for image in a/*.d64; do
+    name=$(basename "$image")
+    cmp -s "$image" "b/$name" || fail "$name differs for the same seed"
+done
+for image in c/*.d64; do
+    name=$(basename "$image")
+    cmp -s "$image" "a/$name" || fail "$name depends on the image count"
+done
+sed 's|^a/||' a.txt > a.report
+sed 's|^b/||' b.txt > b.report
+cmp -s a.report b.report || fail "reports differ for the same seed"
+
+same=0
+for image in a/*.d64; do
+    if cmp -s "$image" "d/$(basename "$image")"; then
+        same=$((same + 1))
+    fi
+done
+[ "$same" -eq 0 ] || fail "$same images did not change with the seed"
+echo "generate: 8 images reproduced"
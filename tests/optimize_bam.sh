@@ -0,0 +1,37 @@
+#!/bin/sh
+# optimize keeps the files and the BAM: an image with BAM errors still
+# has the same errors afterwards, a valid image stays valid.
+# usage: optimize_bam.sh path/to/d64cli
+set -eu
+d64cli=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+# error counts of an image in a many-image json report
+errors() { sed -n "s|^{\"image\":\"$1\".*\"ok\":\([a-z]*\).*\"errors\":\(.*\)}|\1 \2|p" "$2"; }
+
+"$d64cli" generate img --count 8 --seed 5 --corrupt 50 > /dev/null
+"$d64cli" verify img --format json > before.json || true
+
+for image in img/*.d64; do
+    name=$(basename "$image" .d64)
+    mkdir "$name.before" "$name.after"
+    (cd "$name.before" && "$d64cli" extract "../$image" --all > /dev/null)
+    "$d64cli" optimize "$image" > /dev/null || fail "optimize $image failed"
+    (cd "$name.after" && "$d64cli" extract "../$image" --all > /dev/null)
+    diff -r "$name.before" "$name.after" > /dev/null || fail "$image: files changed"
+done
+
+"$d64cli" verify img --format json > after.json || true
+errors=0
+for image in img/*.d64; do
+    [ "$(errors "$image" before.json)" = "$(errors "$image" after.json)" ] || fail "$image: BAM errors changed"
+    case "$(errors "$image" before.json)" in
+        false*) errors=$((errors + 1)) ;;
+    esac
+done
+[ "$errors" -gt 0 ] || fail "no image with BAM errors"
+echo "optimize: 8 images, $errors with their BAM errors kept"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# verify of one image and of many images agree, --fix repairs what
+# verify reports and only images that changed are counted as fixed.
+# usage: verify_fix.sh path/to/d64cli
+set -eu
+d64cli=$1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+# ok of an image in a many-image json report
+many_ok() { sed -n "s|^{\"image\":\"$1\".*\"ok\":\([a-z]*\).*|\1|p" "$2"; }
+# valid of a single-image json report
+single_valid() { "$d64cli" verify "$1" --format json | sed -n 's|.*"valid":\([a-z]*\).*|\1|p'; }
+
+"$d64cli" generate img --count 8 --seed 11 --corrupt 100 > /dev/null
+cp img/disk00001.d64 single.d64
+
+"$d64cli" verify img --format json > before.json || true
+bad=0
+for image in img/*.d64; do
+    ok=$(many_ok "$image" before.json)
+    [ "$ok" = "$(single_valid "$image")" ] || fail "$image: many-image verify says $ok, single verify disagrees"
+    [ "$ok" = true ] || bad=$((bad + 1))
+done
+[ "$bad" -gt 0 ] || fail "no image with BAM errors to fix"
+
+"$d64cli" verify img --fix --format json > fix.json || true
+grep -q "\"fixed\":$bad," fix.json || fail "expected $bad fixed images"
+"$d64cli" verify img > /dev/null || fail "images still have errors after --fix"
+for image in img/*.d64; do
+    [ "$(single_valid "$image")" = true ] || fail "$image fails single verify after --fix"
+done
+"$d64cli" verify img --fix --format json > again.json
+grep -q '"fixed":0,' again.json || fail "valid images were counted as fixed"
+
+if [ "$(single_valid single.d64)" = false ]; then
+    "$d64cli" verify single.d64 --fix --format json | grep -q '"fixed":true' || fail "single --fix did not fix"
+    "$d64cli" verify single.d64 --fix --format json | grep -q '"fixed":false' || fail "single --fix fixed a valid image"
+fi
+echo "verify: $bad images fixed"
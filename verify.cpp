@@ -0,0 +1,209 @@
+#include <numeric>
+
+#include "filelock.h"
+#include "session.h"
+#include "verify.h"
+#include "workers.h"
+
+int VerifyReport::total() const
+{
+    return std::accumulate(errors.begin(), errors.end(), 0);
+}
+
+/// <summary>
+/// Name of an error class for reports
+/// </summary>
+const char* verifyErrorName(int error)
+{
+    switch (error) {
+        case free_count: return "free_count";
+        case used_marked_free: return "used_marked_free";
+        case leaked_sector: return "leaked_sector";
+    }
+    return "";
+}
+
+/// <summary>
+/// Check the BAM of a loaded image with verifyBAMIntegrity,
+/// the same check as the verify of a single image.
+/// When the check fails the BAM is repaired in memory and the
+/// errors are counted from the sectors the repair changed; the
+/// caller saves the image to keep the repair or drops it.
+/// </summary>
+/// <param name="disk">loaded image, repaired if it has errors</param>
+/// <param name="report">gets the result and the error counts</param>
+/// <returns>true if the repair changed the BAM</returns>
+bool checkImage(d64& disk, VerifyReport& report)
+{
+    report.errors = {};
+    auto before = disk.readSector(DIR_TRACK, 0);
+    report.readable = before.has_value() && before->size() >= SECTOR_SIZE;
+    if (!report.readable) {
+        return false;
+    }
+    report.valid = disk.verifyBAMIntegrity(false, "");
+    if (report.valid) {
+        return false;
+    }
+
+    disk.verifyBAMIntegrity(true, "");
+    auto after = disk.readSector(DIR_TRACK, 0);
+    if (!after.has_value() || *after == *before) {
+        return false;
+    }
+
+    auto isFree = [](const std::vector<uint8_t>& bam, int track, int sector) {
+        return (bam[bamOffset(track) + 1 + sector / 8] & (1 << (sector % 8))) != 0;
+    };
+    for (auto track = 1; track <= disk.TRACKS; ++track) {
+        auto moved = false;
+        for (auto sector = 0; sector < sectorsPerTrack(track); ++sector) {
+            auto wasFree = isFree(*before, track, sector);
+            if (wasFree != isFree(*after, track, sector)) {
+                ++report.errors[wasFree ? used_marked_free : leaked_sector];
+                moved = true;
+            }
+        }
+        if (!moved && (*before)[bamOffset(track)] != (*after)[bamOffset(track)]) {
+            ++report.errors[free_count];
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Check many images on a pool of threads.
+/// With fix, images whose repair changed the BAM are
+/// saved and checked again.
+/// Each image is locked while it is checked, exclusive with fix.
+/// </summary>
+/// <param name="paths">image files</param>
+/// <param name="fix">repair and save images with errors</param>
+/// <param name="lockTimeout">time to wait for an image locked by another process</param>
+/// <returns>a report for each image in order</returns>
+std::vector<VerifyReport> verifyImages(const std::vector<std::string>& paths, bool fix, int lockTimeout)
+{
+    std::vector<VerifyReport> reports(paths.size());
+    parallelFor(paths.size(), [&](size_t i) {
+        auto& report = reports[i];
+        report.path = paths[i];
+        FileLock lock;
+        if (!lock.acquire(paths[i], fix, lockTimeout)) {
+            report.locked = true;
+            return;
+        }
+        DiskSession session;
+        if (!session.open(paths[i])) {
+            return;
+        }
+        if (checkImage(session.disk(), report) && fix && session.commit()) {
+            report.fixed = true;
+            report.valid = session.disk().verifyBAMIntegrity(false, "");
+            if (report.valid) {
+                report.errors = {};
+            }
+        }
+    });
+    return reports;
+}
+
+/// <summary>
+/// Print the result of a verify of many images
+/// </summary>
+/// <param name="reports">result of each image</param>
+/// <param name="out">output in the selected format</param>
+void printVerify(const std::vector<VerifyReport>& reports, OutputBuffer& out)
+{
+    std::array<int, VERIFY_ERROR_CLASSES> totals{};
+    auto ok = 0, failed = 0, unreadable = 0, locked = 0, fixed = 0;
+    for (const auto& report : reports) {
+        for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+            totals[e] += report.errors[e];
+        }
+        ok += report.ok();
+        failed += report.readable && !report.ok();
+        unreadable += !report.readable && !report.locked;
+        locked += report.locked;
+        fixed += report.fixed;
+    }
+
+    if (out.json()) {
+        out << "{\"images\":[";
+        for (size_t i = 0; i < reports.size(); ++i) {
+            const auto& report = reports[i];
+            out << (i ? ",\n" : "\n") << "{\"image\":";
+            out.jsonString(report.path) << ",\"readable\":";
+            out.boolean(report.readable) << ",\"locked\":";
+            out.boolean(report.locked) << ",\"ok\":";
+            out.boolean(report.ok()) << ",\"fixed\":";
+            out.boolean(report.fixed) << ",\"errors\":{";
+            for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+                out << (e ? "," : "") << "\"" << verifyErrorName(e) << "\":" << report.errors[e];
+            }
+            out << "}}";
+        }
+        out << "\n],\"totals\":{\"images\":" << reports.size() << ",\"ok\":" << ok << ",\"errors\":" << failed
+            << ",\"unreadable\":" << unreadable << ",\"locked\":" << locked << ",\"fixed\":" << fixed;
+        for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+            out << ",\"" << verifyErrorName(e) << "\":" << totals[e];
+        }
+        out << "}}\n";
+        return;
+    }
+
+    if (out.csv()) {
+        out << "image,readable,locked,fixed";
+        for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+            out << ',' << verifyErrorName(e);
+        }
+        out << '\n';
+        for (const auto& report : reports) {
+            out.csvField(report.path) << ',' << (report.readable ? "1" : "0") << ',' << (report.locked ? "1" : "0") << ',' << (report.fixed ? "1" : "0");
+            for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+                out << ',' << report.errors[e];
+            }
+            out << '\n';
+        }
+        return;
+    }
+
+    auto describe = [](const std::array<int, VERIFY_ERROR_CLASSES>& errors) {
+        std::string text;
+        for (auto e = 0; e < VERIFY_ERROR_CLASSES; ++e) {
+            if (errors[e] > 0) {
+                text += (text.empty() ? "" : ", ") + std::string(verifyErrorName(e)) + " " + std::to_string(errors[e]);
+            }
+        }
+        return text;
+    };
+
+    for (const auto& report : reports) {
+        out << report.path << ": ";
+        if (report.locked) {
+            out << "locked by another process";
+        }
+        else if (!report.readable) {
+            out << "not a valid image";
+        }
+        else if (report.ok()) {
+            out << (report.fixed ? "fixed" : "ok");
+        }
+        else {
+            out << (report.total() > 0 ? std::to_string(report.total()) + " errors (" + describe(report.errors) + ")" : "BAM errors")
+                << (report.fixed ? " after fix" : "");
+        }
+        out << '\n';
+    }
+    out << "Verified " << reports.size() << " images: " << ok << " ok, " << failed << " with errors, "
+        << unreadable << " unreadable";
+    if (locked > 0) {
+        out << ", " << locked << " locked";
+    }
+    if (fixed > 0) {
+        out << ", " << fixed << " fixed";
+    }
+    out << '\n';
+    if (failed > 0 && !describe(totals).empty()) {
+        out << "Errors: " << describe(totals) << '\n';
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <array>
+#include <string>
+#include <vector>
+
+#include "d64view.h"
+#include "output.h"
+
+/// <summary>
+/// Kinds of errors found by checkImage, told apart by what
+/// the repair of verifyBAMIntegrity changes in the BAM
+/// </summary>
+enum VerifyError {
+    free_count,         // free count of a track is corrected, its bitmap is not
+    used_marked_free,   // sector marked free is marked used
+    leaked_sector,      // sector marked used is marked free
+    VERIFY_ERROR_CLASSES
+};
+
+/// <summary>
+/// Result of checking one image
+/// </summary>
+struct VerifyReport {
+    std::string path;
+    bool readable = false;
+    bool locked = false;        // locked by another process, not checked
+    bool valid = false;         // verifyBAMIntegrity passed
+    bool fixed = false;         // --fix changed the image and it was saved
+    std::array<int, VERIFY_ERROR_CLASSES> errors{};
+
+    int total() const;
+    bool ok() const { return readable && valid; }
+};
+
+const char* verifyErrorName(int error);
+bool checkImage(d64& disk, VerifyReport& report);
+std::vector<VerifyReport> verifyImages(const std::vector<std::string>& paths, bool fix, int lockTimeout);
+void printVerify(const std::vector<VerifyReport>& reports, OutputBuffer& out);
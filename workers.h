@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Number of worker threads to use for a number of jobs
+/// </summary>
+/// <param name="jobs">number of jobs</param>
+/// <returns>thread count, at least 1</returns>
+inline size_t workerCount(size_t jobs)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, std::min(threads, jobs));
+}
+
+/// <summary>
+/// Call fn(i) for every i in [0, count) on a pool of threads
+/// </summary>
+/// <param name="count">number of jobs</param>
+/// <param name="fn">job function, must be thread safe</param>
+template <class Fn>
+void parallelFor(size_t count, Fn fn)
+{
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&] {
+        for (auto i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    auto threads = workerCount(count);
+    for (size_t t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+/// <summary>
+/// Produce items on a pool of threads and consume them in order
+/// on the calling thread. At most window items are produced ahead
+/// of the consumer.
+/// </summary>
+/// <param name="count">number of items</param>
+/// <param name="produce">T produce(i), must be thread safe</param>
+/// <param name="consume">void consume(i, T&amp;)</param>
+/// <param name="window">read ahead limit, 0 for twice the thread count</param>
+template <class T, class Produce, class Consume>
+void orderedPipeline(size_t count, Produce produce, Consume consume, size_t window = 0)
+{
+    std::vector<std::optional<T>> slots(count);
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    size_t next = 0;
+    size_t consumed = 0;
+
+    auto threads = workerCount(count);
+    if (window == 0) {
+        window = threads * 2;
+    }
+
+    auto worker = [&] {
+        while (true) {
+            size_t i;
+            {
+                std::unique_lock lock(mutex);
+                space.wait(lock, [&] { return next >= count || next < consumed + window; });
+                if (next >= count) return;
+                i = next++;
+            }
+            T item = produce(i);
+            {
+                std::lock_guard lock(mutex);
+                slots[i] = std::move(item);
+            }
+            ready.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+
+    auto stop = [&] {
+        {
+            std::lock_guard lock(mutex);
+            next = count;
+        }
+        space.notify_all();
+        for (auto& thread : pool) {
+            thread.join();
+        }
+    };
+
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            T item;
+            {
+                std::unique_lock lock(mutex);
+                ready.wait(lock, [&] { return slots[i].has_value(); });
+                item = std::move(*slots[i]);
+                slots[i].reset();
+                consumed = i + 1;
+            }
+            space.notify_all();
+            consume(i, item);
+        }
+    }
+    catch (...) {
+        stop();
+        throw;
+    }
+    stop();
+}